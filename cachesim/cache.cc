@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
 
 #include "cache.h"
 #include "lru_fsm_1way.h"
@@ -47,6 +48,17 @@ void cache_t::print(FILE* f)
 
 
 
+// zero pages are placed on the NUMA node of the thread first using them
+static void* zeroed(size_t bytes)
+{
+  void* p = mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "cannot allocate %ld bytes for cache tags\n", bytes);
+    syscall(SYS_exit_group, -1);
+  }
+  return p;
+}
+
 fsm_cache_t::fsm_cache_t(const char* nam, int w, int lin, int row, bool writeable)
   : cache_t(nam, w, lin, row, writeable)
 {
@@ -63,9 +75,8 @@ fsm_cache_t::fsm_cache_t(const char* nam, int w, int lin, int row, bool writeabl
   } /* note fsm purposely point to [-1] */
   tags = new fsm_tag_t*[ways];
   for (int k=0; k<ways; k++)
-    tags[k] = new fsm_tag_t[rows];
-  states = new unsigned short[rows];
-  flush();
+    tags[k] = (fsm_tag_t*)zeroed(rows*sizeof(fsm_tag_t));
+  states = (unsigned short*)zeroed(rows*sizeof(unsigned short));
 }
 
 void fsm_cache_t::flush()
@@ -23,9 +23,11 @@ struct cache_t {			// cache descriptor
   long misses() { return _misses; }
   long updates() { return _updates; }
   long evictions() { return _evictions; }
+  void clear_stats() { _refs=_misses=_updates=_evictions=0; }
   void print(FILE* f =stderr);
   
   virtual bool lookup(long addr, bool write =false) =0;
+  virtual void warm(long addr, bool write =false) =0; // update tags only, no statistics
   virtual void flush() =0;
 };
 
@@ -48,6 +50,7 @@ class fsm_cache_t : public cache_t {
 public:  
   fsm_cache_t(const char* nam, int w, int lin, int row, bool writeable);
   bool lookup(long addr, bool write =false);
+  void warm(long addr, bool write =false);
   void flush();
   void print(FILE* f =stderr);
 };
@@ -71,6 +74,7 @@ class ll_cache_t : public cache_t {
 public:
   ll_cache_t(const char* nam, int w, int lin, int row, bool writeable);
   bool lookup(long addr, bool write =false);
+  void warm(long addr, bool write =false);
   void flush();
 };
 
@@ -116,6 +120,29 @@ inline bool fsm_cache_t::lookup(long addr, bool write)
 
 
 
+inline void fsm_cache_t::warm(long addr, bool write)
+{
+  addr >>= lg_line;
+  int index = addr & row_mask;
+  unsigned short* state = states + index;
+  struct lru_fsm_t* p = fsm + *state;
+  struct lru_fsm_t* end = p + ways;
+  struct fsm_tag_t* tag;
+  do {
+    p++;
+    tag = tags[p->way] + index;
+    if (addr == tag->addr)
+      goto cache_hit;
+  } while (p < end);
+  tag->addr = addr;		// replace LRU line
+  tag->dirty = 0;
+ cache_hit:
+  *state = p->next_state;
+  if (write)
+    tag->dirty = 1;
+}
+
+
 
 inline bool ll_cache_t::lookup(long addr, bool write)
 {
@@ -168,6 +195,30 @@ inline bool ll_cache_t::lookup(long addr, bool write)
 }
 
 
+inline void ll_cache_t::warm(long addr, bool write)
+{
+  addr >>= lg_line;
+  int index = addr & row_mask;
+  ll_tag_t* p = mru[index];
+  ll_tag_t* q = 0;
+  while (p->next && addr != p->tag.addr) {
+    q = p;
+    p = p->next;
+  } // p points to hit or last element
+  if (addr != p->tag.addr) {
+    p->tag.addr = addr;
+    p->tag.dirty = 0;
+  }
+  if (q) {			// move to MRU
+    q->next = p->next;
+    p->next = mru[index];
+    mru[index] = p;
+  }
+  if (write)
+    p->tag.dirty = 1;
+}
+
+
 
 cache_t* new_cache(const char* nam, int w, int lin, int row, bool writeable);
 
@@ -1,10 +1,29 @@
 #include <limits.h>
 #include <unistd.h>
+#include <math.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 #include "caveat.h"
 #include "hart.h"
+#include "trace.h"
+#include "scheduler.h"
+#include "record.h"
+#include "affinity.h"
+#include "symbols.h"
+#include "region.h"
 #include "cache.h"
+#include "llc.h"
+#include "live.h"
+#include "profile.h"
+#include "calls.h"
 
 option<int> conf_Dways("dways", 4,		"Data cache number of ways associativity");
 option<int> conf_Dline("dline",	6,		"Data cache log-base-2 line size");
@@ -13,62 +32,544 @@ option<int> conf_Dmiss("dmiss",	50,		"Data cache miss penalty");
 
 option<long> conf_report("report", 1, "Status report per second");
 
+option<>     conf_replay ("replay",	0,		"Replay trace file instead of running program");
+option<int>  conf_threads("threads",	1,		"Host threads replaying disjoint trace chunks");
+option<int>  conf_warmup ("warmup",	1,		"Chunks replayed before each thread to warm caches");
+
+option<long> conf_sample ("sample",	0,		"Sampled simulation detailed window instructions, 0=off");
+option<long> conf_period ("period",	1000000,	"Sampled simulation instructions between windows");
+option<long> conf_fwarm  ("fwarm",	100000,		"Sampled simulation cache warming instructions before window");
+
+option<int>  conf_lines  ("lines",	0,		"Report data cache misses of this many worst source lines");
+option<bool> conf_regions("regions",	false, true,	"Report data cache references and misses by memory region");
+
+option<>     conf_sweep  ("sweep",	0,		"Fork one simulation per cache configuration in file");
+option<long> conf_ffwd   ("ffwd",	0,		"Instructions to fast forward before --sweep forks");
+
+option<long> conf_quantum("quantum",	0,		"Cores run at most this many cycles ahead of slowest, 0=unsynchronized");
+
+#define futex(a, b, c)  syscall(SYS_futex, a, b, c, 0, 0, 0)
+
+void simulator(hart_t* h, Header_t* bb, uintptr_t* ap);
+void warm_simulator(hart_t* h, Header_t* bb, uintptr_t* ap);
+bool sample_event(hart_t* h);
+
 class core_t : public hart_t {
   
   static volatile long global_time;
+  static volatile int global_number; // lowest numbered core at global_time
+  static int cores;		// for numbering
   long local_time;
+  int number;			// creation order, breaks ties deterministically
+  bool in_syscall;		// not counted in global_time
+  long sync_at;			// synchronize() when local_time reaches this
+  int llc_slot;			// clock slot in shared LLC
+
+  // SMARTS-style sampling alternates these phases
+  enum { Fast, Warming, Detailed, Number_of_Phases } phase;
+  bool window_open;		// Detailed phase statistics started
+  long window_insns, window_time, window_refs, window_misses; // at window start
+  long detail_insns;		// total in all windows
+  long windows;
+  double cpi_sum, cpi_sq;	// per-window cycles per instruction
+  double mr_sum, mr_sq;		// per-window data cache miss ratio
   
   void initialize() {
     dc = new_cache("Data",   conf_Dways(), conf_Dline(), conf_Drows(), true);
     local_time = global_time;
+    number = __sync_fetch_and_add(&cores, 1);
+    in_syscall = false;
+    sync_at = conf_quantum() ? local_time : LONG_MAX;
+    llc_refs = llc_misses = 0;
+    if (conf_llc()) {
+      llc_slot = ::llc_slot();
+      sync_at = local_time;
+    }
+    window_open = false;
+    detail_insns = windows = 0;
+    cpi_sum = cpi_sq = mr_sum = mr_sq = 0;
+    memset(region_refs, 0, sizeof region_refs);
+    memset(region_misses, 0, sizeof region_misses);
   }
   
 public:
   cache_t* dc;
+  unordered_map<uintptr_t, long> pc_misses; // --lines
+  long llc_refs, llc_misses;	// --llc
+  long region_refs[Number_of_Regions];	// --regions
+  long region_misses[Number_of_Regions];
   
-  core_t(hart_t* from) :hart_t(from) { initialize(); }
+  core_t(hart_t* from) :hart_t(from) {
+    initialize();
+    if (conf_sample() && (!conf_roi() || from->simulator))
+      start_sampling();
+  }
   core_t(int argc, const char* argv[], const char* envp[]) :hart_t(argc, argv, envp) { initialize(); }
+  core_t() :hart_t() { initialize(); }
   
   void addtime(long delta) { local_time+=delta; }
   long local_clock() { return local_time; }
   
   long system_clock() { return global_time; }
   void update_time();
+  bool may_run();
+  void synchronize();
+  void leave_time();
+  void join_time();
+  bool must_sync() { return local_time >= sync_at; }
+  void reset_stats() {
+    clear_executed();
+    dc->clear_stats();
+    local_time = 0;
+    llc_refs = llc_misses = 0;
+    window_open = false;
+    detail_insns = windows = 0;
+    cpi_sum = cpi_sq = mr_sum = mr_sq = 0;
+    pc_misses.clear();
+    memset(region_refs, 0, sizeof region_refs);
+    memset(region_misses, 0, sizeof region_misses);
+  }
+  void count_miss(Header_t* bb, const Insn_t* i);
+  long measured() { return conf_sample() ? detail_insns : executed(); }
+
+  void start_sampling() { phase=Detailed; next_phase(); }
+  void next_phase();
+  void begin_window();
+  void end_window();
+  void print_samples(FILE* f =stderr);
   
   static core_t* list() { return (core_t*)hart_t::list(); }
   core_t* next() { return (core_t*)hart_t::next(); }
 };
 
 volatile long core_t::global_time;
+volatile int core_t::global_number;
+int core_t::cores;
 
 void simulator(hart_t* h, Header_t* bb, uintptr_t* ap)
 {
   core_t* core = (core_t*)h;
   const Insn_t* i = insnp(bb+1);
+  live_t* c = live_at(bb->addr, bb->length); // --live, advances by parcels
   core->addtime(bb->count);
   for (long k=0; k<bb->count; k++, i++) {
     ATTR_bv_t attr = attributes[i->opcode()];
+    if (c) {
+      c->count++;
+      c->cycles++;
+    }
     if (attr & (ATTR_ld|ATTR_st)) {
-      if (!core->dc->lookup(*ap++, (attr&ATTR_st)!=0))
-	core->addtime(conf_Dmiss());
+      uintptr_t a = *ap++;
+      bool hit = core->dc->lookup(a, (attr&ATTR_st)!=0);
+      if (!hit) {
+	long penalty = conf_Dmiss();
+	if (conf_llc()) {
+	  core->llc_refs++;
+	  if (!llc_lookup(a)) {
+	    core->llc_misses++;
+	    penalty += conf_Lmiss();
+	  }
+	}
+	core->addtime(penalty);
+	if (c) {
+	  c->dmiss++;
+	  c->cycles += penalty;
+	}
+	if (conf_lines())
+	  core->count_miss(bb, i);
+      }
+      if (conf_regions()) {
+	region_kind_t r = region_of(a);
+	core->region_refs[r]++;
+	core->region_misses[r] += !hit;
+      }
     }
+    if (c)
+      c += i->compressed() ? 1 : 2;
+  }
+  if (core->must_sync())
+    core->synchronize();
+}
+
+// pc is not kept per instruction, recover it from basic block
+void core_t::count_miss(Header_t* bb, const Insn_t* i)
+{
+  uintptr_t pc = bb->addr;
+  for (const Insn_t* j=insnp(bb+1); j<i; j++)
+    pc += j->compressed() ? 2 : 4;
+  pc_misses[pc]++;
+}
+
+void warm_simulator(hart_t* h, Header_t* bb, uintptr_t* ap)
+{
+  core_t* core = (core_t*)h;
+  const Insn_t* i = insnp(bb+1);
+  for (long k=0; k<bb->count; k++, i++) {
+    ATTR_bv_t attr = attributes[i->opcode()];
+    if (attr & (ATTR_ld|ATTR_st))
+      core->dc->warm(*ap++, (attr&ATTR_st)!=0);
   }
 }
 
+bool sample_event(hart_t* h)
+{
+  ((core_t*)h)->next_phase();
+  return false;
+}
+
+void core_t::next_phase()
+{
+  if (phase == Detailed && window_open)
+    end_window();
+  long gap = conf_period() - conf_sample();
+  long warm = conf_fwarm() < gap ? conf_fwarm() : gap;
+  long length[Number_of_Phases] = { gap-warm, warm, conf_sample() };
+  do phase = (decltype(phase))((phase+1) % Number_of_Phases);
+  while (length[phase] == 0);
+  simulator = phase==Fast ? 0 : phase==Warming ? warm_simulator : ::simulator;
+  event = sample_event;
+  event_at = executed() + length[phase];
+  if (phase == Detailed)
+    begin_window();
+}
+
+void core_t::begin_window()
+{
+  window_insns = executed();
+  window_time = local_time;
+  window_refs = dc->refs();
+  window_misses = dc->misses();
+  window_open = true;
+}
+
+void core_t::end_window()
+{
+  long n = executed() - window_insns;
+  long refs = dc->refs() - window_refs;
+  double cpi = (double)(local_time - window_time) / n;
+  double mr = refs ? (double)(dc->misses() - window_misses) / refs : 0;
+  detail_insns += n;
+  windows++;
+  cpi_sum += cpi;
+  cpi_sq  += cpi*cpi;
+  mr_sum += mr;
+  mr_sq  += mr*mr;
+  window_open = false;
+}
+
+// mean and 99.7% confidence interval half width as percent of mean
+static void confidence(double sum, double sq, long n, double& mean, double& pct)
+{
+  mean = sum / n;
+  double var = n > 1 ? (sq - n*mean*mean) / (n-1) : 0;
+  if (var < 0)
+    var = 0;
+  pct = mean > 0 ? 100.0 * 3.0*sqrt(var/n) / mean : 0;
+}
+
+void core_t::print_samples(FILE* f)
+{
+  if (windows == 0) {
+    fprintf(f, "  no complete sample windows\n");
+    return;
+  }
+  double cpi, cpi_pct, mr, mr_pct;
+  confidence(cpi_sum, cpi_sq, windows, cpi, cpi_pct);
+  confidence(mr_sum, mr_sq, windows, mr, mr_pct);
+  fprintf(f, "  %ld windows of %ld insns every %ld, %ld warming\n", windows, conf_sample(), conf_period(), conf_fwarm());
+  fprintf(f, "  CPI %6.4f +- %4.2f%%\n", cpi, cpi_pct);
+  fprintf(f, "  D$ miss ratio %7.5f%% +- %4.2f%% (99.7%% confidence)\n", 100*mr, mr_pct);
+}
+
+/*
+  With --quantum=Q no core runs more than about Q cycles ahead of the
+  slowest core not blocked in a system call.  A core that gets too far
+  ahead sleeps on a futex until global time advances.  Q=1 runs one
+  core at a time in (local_time, number) order, a deterministic
+  interleaving.
+*/
+
+static pthread_mutex_t time_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int time_generation;	// futex, bumped when global time advances
+static volatile int time_waiters;
+
+// call holding time_lock
 void core_t::update_time()
 {
-  long last_local = LONG_MAX;
+  long least = LONG_MAX;
+  int first = INT_MAX;
+  hart_t::begin_walk();
   for (core_t* p=core_t::list(); p; p=p->next()) {
-    if (p->local_time < last_local)
-      last_local = p->local_time;
+    if (p->in_syscall)
+      continue;
+    if (p->local_time < least || p->local_time == least && p->number < first) {
+      least = p->local_time;
+      first = p->number;
+    }
   }
-  dieif(last_local<global_time, "local %ld < %ld global", last_local, global_time);
-  global_time = last_local;
+  hart_t::end_walk();
+  if (least == LONG_MAX || least < global_time)	// all blocked, or core just joining
+    return;
+  if (least == global_time && first == global_number)
+    return;
+  global_time = least;
+  global_number = first;
+  time_generation++;
+  if (time_waiters)
+    futex(&time_generation, FUTEX_WAKE, INT_MAX);
+}
+
+bool core_t::may_run()
+{
+  if (conf_quantum() == 1)
+    return local_time == global_time && number == global_number;
+  return local_time < global_time + conf_quantum();
+}
+
+void core_t::synchronize()
+{
+  if (conf_llc()) {		// with cores in other processes
+    llc_clock(llc_slot, local_time);
+    sync_at = local_time + (conf_skew() > 1 ? conf_skew()/2 : 1);
+    return;
+  }
+  for (;;) {
+    int generation = time_generation;
+    pthread_mutex_lock(&time_lock);
+    update_time();
+    bool go = may_run();
+    if (!go)
+      time_waiters++;
+    pthread_mutex_unlock(&time_lock);
+    if (go)
+      break;
+    futex(&time_generation, FUTEX_WAIT, generation);
+    __sync_fetch_and_sub(&time_waiters, 1);
+  }
+  // check again halfway through quantum so slowest core keeps others moving
+  long q = conf_quantum();
+  sync_at = q > 1 ? local_time + q/2 : local_time + 1;
+  if (q > 1 && sync_at > global_time + q)
+    sync_at = global_time + q;
+}
+
+// entering system call that may block, stop holding back other cores
+void core_t::leave_time()
+{
+  if (conf_llc()) {
+    llc_leave(llc_slot);
+    return;
+  }
+  pthread_mutex_lock(&time_lock);
+  in_syscall = true;
+  update_time();
+  pthread_mutex_unlock(&time_lock);
+}
+
+void core_t::join_time()
+{
+  if (conf_llc()) {
+    local_time = llc_join(llc_slot, local_time);
+    sync_at = local_time;
+    return;
+  }
+  pthread_mutex_lock(&time_lock);
+  if (local_time < global_time)	// time passed while we were away
+    local_time = global_time;
+  in_syscall = false;
+  pthread_mutex_unlock(&time_lock);
+  sync_at = local_time;		// wait our turn before next block
+}
+
+long core_cycles(hart_t* h)
+{
+  return ((core_t*)h)->local_clock();
+}
+
+static const char* core_events[] = { "drefs", "dmisses", "dupdates", "devictions", 0 };
+
+long core_counter(hart_t* h, int event)
+{
+  cache_t* dc = ((core_t*)h)->dc;
+  switch (event) {
+  case 0:  return dc->refs();
+  case 1:  return dc->misses();
+  case 2:  return dc->updates();
+  case 3:  return dc->evictions();
+  }
+  return 0;
+}
+
+long cachesim_syscall(hart_t* h, long a0)
+{
+  core_t* core = (core_t*)h;
+  core->leave_time();
+  long rv = default_riscv_syscall(h, a0);
+  core->join_time();
+  return rv;
+}
+
+hart_t* replay_core()
+{
+  return new core_t();
+}
+
+void replay_warmed(hart_t* h)
+{
+  ((core_t*)h)->reset_stats();
+}
+
+/*
+  --sweep=file runs the guest functionally up to the ROI marker (with
+  --roi), --ffwd instructions, or not at all, then forks a child per
+  line "ways line rows miss" of the file.  Children share everything
+  before the fork copy-on-write, simulate to the end with their own
+  data cache and send back statistics through a pipe.  The parent
+  prints one table.  Only the first child keeps guest stdout.
+*/
+
+struct sweep_config_t {
+  int ways, line, rows, miss;
+};
+
+struct sweep_result_t {		// less than PIPE_BUF, written atomically
+  int config;
+  long insns, cycles;
+  long refs, misses, updates, evictions;
+};
+
+static int sweep_fd = -1;	// write end of pipe in children
+static int sweep_config;
+
+static void set_option(options_t& o, int v)
+{
+  char buf[32];
+  snprintf(buf, sizeof buf, "%d", v);
+  o.setval(buf);
+}
+
+static void sweep(core_t* core)
+{
+  quitif(hart_t::num_harts() > 1, "--sweep needs a single threaded guest when it forks");
+  vector<sweep_config_t> configs;
+  FILE* f = fopen(conf_sweep(), "r");
+  quitif(!f, "Cannot open sweep file %s", conf_sweep());
+  char buf[1000];
+  while (fgets(buf, sizeof buf, f)) {
+    sweep_config_t c;
+    if (sscanf(buf, " %d %d %d %d", &c.ways, &c.line, &c.rows, &c.miss) == 4)
+      configs.push_back(c);
+    else
+      quitif(buf[strspn(buf, " \t\n")] && buf[strspn(buf, " \t")] != '#', "Bad line in sweep file %s: %s", conf_sweep(), buf);
+  }
+  fclose(f);
+  quitif(configs.empty(), "No configurations in sweep file %s", conf_sweep());
+  wait_symbols();		// threads are not inherited
+  fflush(stdout);
+  fflush(stderr);
+  int fd[2];
+  dieif(pipe(fd), "sweep pipe failed");
+  fprintf(stderr, "Sweep of %ld configurations after %ld insns\n", configs.size(), core->executed());
+  for (int k=0; k<configs.size(); k++) {
+    pid_t pid = fork();
+    dieif(pid<0, "sweep fork failed");
+    if (pid == 0) {
+      close(fd[0]);
+      sweep_fd = fd[1];
+      sweep_config = k;
+      pin_thread(k);
+      if (k > 0) {
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, 1);
+	close(null);
+      }
+      set_option(conf_Dways, configs[k].ways);
+      set_option(conf_Dline, configs[k].line);
+      set_option(conf_Drows, configs[k].rows);
+      set_option(conf_Dmiss, configs[k].miss);
+      core->dc = new_cache("Data", conf_Dways(), conf_Dline(), conf_Drows(), true);
+      core->reset_stats();
+      return;			// child simulates
+    }
+  }
+  close(fd[1]);
+  vector<sweep_result_t> results(configs.size());
+  vector<bool> done(configs.size());
+  sweep_result_t r;
+  while (read(fd[0], &r, sizeof r) == sizeof r) {
+    results[r.config] = r;
+    done[r.config] = true;
+  }
+  while (wait(0) > 0)
+    ;
+  fprintf(stderr, "\n%4s %4s %6s %4s %14s %14s %6s %14s %12s %9s\n",
+	  "ways", "line", "rows", "miss", "insns", "cycles", "IPC", "refs", "misses", "miss%");
+  for (int k=0; k<configs.size(); k++) {
+    sweep_config_t& c = configs[k];
+    fprintf(stderr, "%4d %4d %6d %4d ", c.ways, 1<<c.line, 1<<c.rows, c.miss);
+    sweep_result_t& p = results[k];
+    if (!done[k])
+      fprintf(stderr, "  failed\n");
+    else
+      fprintf(stderr, "%14ld %14ld %6.3f %14ld %12ld %8.4f%%\n", p.insns, p.cycles, (double)p.insns/p.cycles,
+	      p.refs, p.misses, p.refs ? 100.0*p.misses/p.refs : 0.0);
+  }
+  _exit(0);			// parent never simulates
+}
+
+static void sweep_result(core_t* core)
+{
+  sweep_result_t r = { sweep_config, core->measured(), core->local_clock(),
+    core->dc->refs(), core->dc->misses(), core->dc->updates(), core->dc->evictions() };
+  dieif(write(sweep_fd, &r, sizeof r) != sizeof r, "sweep result write failed");
+}
+
+bool sweep_event(hart_t* h)
+{
+  h->event = 0;
+  h->event_at = LONG_MAX;
+  sweep((core_t*)h);
+  h->simulator = simulator;
+  return false;
+}
+
+void cachesim_roi(hart_t* h, int what)
+{
+  core_t* core = (core_t*)h;
+  if (what == ROI_BEGIN) {
+    if (conf_sweep())
+      sweep(core);
+    core->reset_stats();
+    if (conf_sample())
+      core->start_sampling();
+    else
+      core->simulator = simulator;
+  }
+  else if (what == ROI_END) {
+    core->simulator = 0;
+    core->event = 0;
+    core->event_at = LONG_MAX;
+    if (conf_sweep())
+      return;
+    fprintf(stderr, "\n--------\nROI Core [%d] %ld insns ", core->tid(), core->executed());
+    core->dc->print();
+    if (conf_sample())
+      core->print_samples();
+  }
+}
+
+void cachesim_interpreter(hart_t* h)
+{
+  h->default_interpreter();
 }
 
 int clone_proxy(class hart_t* h)
 {
-  core_t* child = new core_t(h);
+  core_t* child = (core_t*)hart_t::reuse(h);
+  if (child)
+    child->join_time();
+  else
+    child = new core_t(h);
   return clone_thread(child);
 }
 
@@ -76,6 +577,7 @@ void status_report()
 {
   double realtime = elapse_time();
   long total = 0;
+  hart_t::begin_walk();
   for (core_t* p= core_t::list(); p; p=p->next()) {
     total += p->executed();
   }
@@ -87,7 +589,7 @@ void status_report()
     char separator = '=';
     for (core_t* p=core_t::list(); p; p=p->next()) {
       fprintf(stderr, "%c", separator);
-      long N = p->executed();
+      long N = p->measured();
       long M = p->dc->refs();
       fprintf(stderr, "%4.2f(%1.0f%%)", (double)N/p->local_clock(), 100.0*p->dc->misses()/N);
       separator = ',';
@@ -95,25 +597,106 @@ void status_report()
   }
   else if (hart_t::num_harts() > 1)
     fprintf(stderr, "(%d cores)", hart_t::num_harts());
+  hart_t::end_walk();
+  if (conf_sysprof())
+    syscall_status();
   last_total = total;
   last_time = realtime;
 }
 
+/*
+  Data cache misses of all cores attributed to source lines with the
+  DWARF line table.  Instructions without line information are
+  counted under their function name.
+*/
+void line_report(FILE* f, int worst)
+{
+  unordered_map<string, long> by_line;
+  long total = 0;
+  for (core_t* p=core_t::list(); p; p=p->next())
+    for (auto& m : p->pc_misses) {
+      char key[4096];
+      int line;
+      long offset;
+      const char* file = find_line(m.first, &line);
+      const char* func;
+      if (file)
+	snprintf(key, sizeof key, "%s:%d", file, line);
+      else if ((func = find_symbol(m.first, &offset)))
+	snprintf(key, sizeof key, "%s", func);
+      else
+	snprintf(key, sizeof key, "??");
+      by_line[key] += m.second;
+      total += m.second;
+    }
+  vector< pair<long, string> > v;
+  for (auto& b : by_line)
+    v.push_back({ b.second, b.first });
+  sort(v.begin(), v.end(), [](const pair<long, string>& a, const pair<long, string>& b) { return a.first > b.first; });
+  fprintf(f, "Data cache misses by source line, worst %d of %ld\n", worst, v.size());
+  fprintf(f, "%12s %7s %7s  %s\n", "misses", "%", "cum%", "line");
+  long sum = 0;
+  for (int k=0; k<worst && k<v.size(); k++) {
+    sum += v[k].first;
+    fprintf(f, "%12ld %6.2f%% %6.2f%%  %s\n", v[k].first, 100.0*v[k].first/total, 100.0*sum/total, v[k].second.c_str());
+  }
+}
+
+void region_report(FILE* f)
+{
+  long refs[Number_of_Regions], misses[Number_of_Regions];
+  long total_misses = 0;
+  memset(refs, 0, sizeof refs);
+  memset(misses, 0, sizeof misses);
+  for (core_t* p=core_t::list(); p; p=p->next())
+    for (int r=0; r<Number_of_Regions; r++) {
+      refs[r] += p->region_refs[r];
+      misses[r] += p->region_misses[r];
+      total_misses += p->region_misses[r];
+    }
+  fprintf(f, "Data cache by region\n");
+  fprintf(f, "%-8s %14s %12s %9s %9s\n", "region", "refs", "misses", "miss%", "of misses");
+  for (int r=0; r<Number_of_Regions; r++)
+    if (refs[r])
+      fprintf(f, "%-8s %14ld %12ld %8.4f%% %8.2f%%\n", region_name[r], refs[r], misses[r],
+	      100.0*misses[r]/refs[r], total_misses ? 100.0*misses[r]/total_misses : 0.0);
+}
+
 void exitfunc()
 {
+  if (sweep_fd >= 0) {
+    sweep_result(core_t::list());
+    return;
+  }
   status_report();
   fprintf(stderr, "\n--------\n");
   for (core_t* p=core_t::list(); p; p=p->next()) {
     fprintf(stderr, "Core [%d] ", p->tid());
     p->dc->print();
+    if (conf_llc())
+      fprintf(stderr, "  LLC %ld refs, %ld misses (%5.3f%%)\n", p->llc_refs, p->llc_misses,
+	      p->llc_refs ? 100.0*p->llc_misses/p->llc_refs : 0.0);
+    if (conf_sample())
+      p->print_samples();
   }
   fprintf(stderr, "\n");
   status_report();
   fprintf(stderr, "\n");
+  if (conf_regions())
+    region_report(stderr);
+  if (conf_lines())
+    line_report(stderr, conf_lines());
+  if (conf_sysprof())
+    syscall_report();
+  if (conf_profile())
+    profile_report(stderr, conf_profile());
+  if (conf_calls())
+    calls_report(stderr);
 }
 
 void* status_thread(void* arg)
 {
+  pin_helper();
   while (1) {
     usleep(1000000/conf_report());
     status_report();
@@ -125,15 +708,70 @@ void* status_thread(void* arg)
 int main(int argc, const char* argv[], const char* envp[])
 {
   parse_options(argc, argv, "cachesim: RISC-V cache simulator");
-  if (argc == 0)
+  if (conf_replay()) {
+    quitif(conf_quantum() || conf_llc() || conf_live(), "--quantum, --llc and --live do not apply to trace replay");
+    atexit(exitfunc);
+    if (conf_report() > 0) {
+      pthread_t tnum;
+      dieif(pthread_create(&tnum, 0, status_thread, 0), "failed to launch status_report thread");
+    }
+    start_time();
+    replay_trace(conf_replay(), conf_threads(), conf_warmup(), replay_core, replay_warmed, simulator);
+    exit(0);
+  }
+  if (argc == 0 && !conf_restore())
     help_exit();
 
+  if (conf_llc()) {
+    quitif(conf_quantum() || conf_sweep(), "--llc cannot be combined with --quantum or --sweep");
+    llc_open();
+  }
   core_t* cpu = new core_t(argc, argv, envp);
+  if (conf_live()) {
+    quitif(conf_sweep(), "--live cannot be combined with --sweep");
+    live_open(argc ? argv[0] : 0);
+  }
   cpu->simulator = simulator;
   cpu->clone = clone_proxy;
+  cpu->interpreter = cachesim_interpreter;
+  cpu->riscv_syscall = default_riscv_syscall;
+  cpu->cycles = core_cycles;
+  cpu->counter = core_counter;
+  hpm_events(core_events);
+  if (conf_quantum()) {
+    quitif(conf_sample() || conf_roi(), "--quantum cannot be combined with --sample or --roi");
+    quitif(conf_workers(), "--quantum cannot be combined with --workers");
+    quitif(conf_playback(), "--quantum cannot be combined with --playback");
+    cpu->riscv_syscall = cachesim_syscall;
+  }
+  if (conf_llc())
+    cpu->riscv_syscall = cachesim_syscall;
+  if (conf_sample()) {
+    quitif(conf_sample() > conf_period(), "--sample=%ld larger than --period=%ld", conf_sample(), conf_period());
+    quitif(cpu->event, "--sample cannot be combined with --checkpoint-at");
+  }
+  if (conf_roi()) {			// fast forward until ROI marker
+    cpu->simulator = 0;
+    cpu->roi = cachesim_roi;
+  }
+  else if (conf_sample())
+    cpu->start_sampling();
+  if (conf_sweep()) {
+    quitif(conf_sample() || conf_quantum() || conf_workers(), "--sweep cannot be combined with --sample, --quantum or --workers");
+    if (conf_roi())
+      ;				// forks at ROI marker
+    else if (conf_ffwd()) {
+      quitif(cpu->event, "--ffwd cannot be combined with --checkpoint-at");
+      cpu->simulator = 0;
+      cpu->event = sweep_event;
+      cpu->event_at = conf_ffwd();
+    }
+    else
+      sweep(cpu);
+  }
   atexit(exitfunc);
 
-  if (conf_report() > 0) {
+  if (conf_report() > 0 && !conf_sweep()) {
     pthread_t tnum;
     dieif(pthread_create(&tnum, 0, status_thread, 0), "failed to launch status_report thread");
   }
@@ -0,0 +1,176 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <vector>
+
+#include "caveat.h"
+#include "llc.h"
+
+option<>     conf_llc  ("llc",	0,		"Shared last level cache segment name, for workload mixes");
+option<int>  conf_Lways("lways",	16,		"Shared LLC number of ways associativity");
+option<int>  conf_Lline("lline",	6,		"Shared LLC log-base-2 line size");
+option<int>  conf_Lrows("lrows",	13,		"Shared LLC log-base-2 number of rows");
+option<int>  conf_Lmiss("lmiss",	200,		"Shared LLC miss penalty");
+option<long> conf_skew ("skew",	10000,		"Shared LLC cores run at most this many cycles ahead of slowest");
+
+#define LLC_MAGIC  0x636c6c6176616321L	// "cavallc!"
+#define LLC_SLOTS  256
+
+struct alignas(64) llc_clock_t {
+  volatile long now;		// LONG_MAX if not running
+};
+
+struct llc_shared_t {
+  volatile uint64_t magic;	// set last by creator
+  int ways, lg_line, lg_rows;
+  volatile int slots;		// clock slots handed out
+  volatile int generation;	// futex, bumped when a clock advances
+  volatile int waiters;
+  llc_clock_t clock[LLC_SLOTS];
+  // rows follow, each a lock word then ways tags, most recently used first
+};
+
+static llc_shared_t* shared;
+static volatile long* rows;	// [rows][ways+1]
+static long row_mask;
+static int ways, lg_line;
+static std::vector<int> mine;	// slots of this process
+
+static long futex_wait(volatile int* addr, int val, long ns)
+{
+  struct timespec ts = { ns/1000000000, ns%1000000000 };
+  return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, 0, 0);
+}
+
+static void leave_all()
+{
+  for (int s : mine)
+    llc_leave(s);
+}
+
+void llc_open()
+{
+  char name[256];
+  snprintf(name, sizeof name, "/cava-llc-%s", conf_llc());
+  ways = conf_Lways();
+  lg_line = conf_Lline();
+  row_mask = (1L<<conf_Lrows()) - 1;
+  size_t size = sizeof(llc_shared_t) + (row_mask+1)*(ways+1)*sizeof(long);
+  int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+  bool creator = fd >= 0;
+  if (creator) {
+    dieif(ftruncate(fd, size), "cannot size shared LLC %s", name);
+  }
+  else {
+    fd = shm_open(name, O_RDWR, 0);
+    quitif(fd<0, "Cannot open shared LLC %s", name);
+    struct stat st;
+    for (int k=0; fstat(fd, &st)==0 && st.st_size < size; k++) { // creator may be sizing it
+      quitif(k==10000, "Shared LLC %s is %ld bytes, expected %ld, geometry differs", name, st.st_size, size);
+      usleep(1000);
+    }
+  }
+  shared = (llc_shared_t*)mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  dieif(shared==MAP_FAILED, "cannot map shared LLC %s", name);
+  close(fd);
+  rows = (volatile long*)(shared+1);
+  if (creator) {		// tags are already zero = empty
+    shared->ways = ways;
+    shared->lg_line = lg_line;
+    shared->lg_rows = conf_Lrows();
+    for (int s=0; s<LLC_SLOTS; s++)
+      shared->clock[s].now = LONG_MAX;
+    __atomic_store_n(&shared->magic, LLC_MAGIC, __ATOMIC_RELEASE);
+  }
+  else {
+    for (int k=0; __atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != LLC_MAGIC; k++) {
+      quitif(k==10000, "Shared LLC %s never initialized", name);
+      usleep(1000);
+    }
+    quitif(shared->ways!=ways || shared->lg_line!=lg_line || shared->lg_rows!=conf_Lrows(),
+	   "Shared LLC %s is %d ways, line 2^%d, rows 2^%d, not as given", name,
+	   shared->ways, shared->lg_line, shared->lg_rows);
+  }
+  atexit(leave_all);
+}
+
+bool llc_lookup(long addr)
+{
+  long tag = (addr >> lg_line) + 1; // 0 means empty
+  volatile long* r = rows + (tag & row_mask)*(ways+1);
+  while (__sync_lock_test_and_set(&r[0], 1))
+    while (r[0])
+      __builtin_ia32_pause();
+  int k = 0;
+  while (k < ways-1 && r[1+k] != tag)
+    k++;
+  bool hit = r[1+k] == tag;
+  for (; k>0; k--)		// move to MRU, else evict LRU
+    r[1+k] = r[k];
+  r[1] = tag;
+  __sync_lock_release(&r[0]);
+  return hit;
+}
+
+int llc_slot()
+{
+  int s = __sync_fetch_and_add(&shared->slots, 1);
+  quitif(s>=LLC_SLOTS, "More than %d cores sharing LLC", LLC_SLOTS);
+  mine.push_back(s);
+  return s;
+}
+
+// slowest running core other than slot
+static long slowest(int slot)
+{
+  long least = LONG_MAX;
+  for (int s=0; s<shared->slots; s++)
+    if (s != slot && shared->clock[s].now < least)
+      least = shared->clock[s].now;
+  return least;
+}
+
+static void advanced()
+{
+  __sync_fetch_and_add(&shared->generation, 1);
+  if (shared->waiters)
+    syscall(SYS_futex, &shared->generation, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+
+void llc_clock(int slot, long now)
+{
+  shared->clock[slot].now = now;
+  advanced();
+  for (;;) {
+    int generation = shared->generation;
+    long least = slowest(slot);
+    if (least == LONG_MAX || now <= least + conf_skew())
+      return;
+    __sync_fetch_and_add(&shared->waiters, 1);
+    futex_wait(&shared->generation, generation, 1000000); // timeout in case wake is missed
+    __sync_fetch_and_sub(&shared->waiters, 1);
+  }
+}
+
+void llc_leave(int slot)
+{
+  shared->clock[slot].now = LONG_MAX;
+  advanced();
+}
+
+long llc_join(int slot, long now)
+{
+  long least = slowest(slot);
+  if (least != LONG_MAX && now < least) // time passed while we were away
+    now = least;
+  shared->clock[slot].now = now;
+  return now;
+}
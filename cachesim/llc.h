@@ -0,0 +1,34 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Last level cache shared by several cachesim processes through a POSIX
+  shared memory segment named by --llc.  Each process keeps private L1
+  models and looks up the shared LLC on an L1 miss.  Sets are locked
+  individually by a spin lock word at the start of each row.  Every
+  core also has a clock slot in the segment; a core more than --skew
+  cycles ahead of the slowest running core in any process waits.  The
+  first process to arrive creates and initializes the segment, the
+  others check its geometry matches.  The mix script launches such
+  workload mixes.
+*/
+
+#ifndef LLC_T
+#define LLC_T
+
+extern option<>     conf_llc;
+extern option<int>  conf_Lways;
+extern option<int>  conf_Lline;
+extern option<int>  conf_Lrows;
+extern option<int>  conf_Lmiss;
+extern option<long> conf_skew;
+
+void llc_open();			// --llc, before first core
+bool llc_lookup(long addr);		// true if hit
+int  llc_slot();			// clock slot for new core
+void llc_clock(int slot, long now);	// publish, wait while too far ahead
+void llc_leave(int slot);		// in system call or exited, others need not wait
+long llc_join(int slot, long now);	// back, returns time to continue at
+
+#endif
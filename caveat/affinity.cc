@@ -0,0 +1,136 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <vector>
+
+#include "caveat.h"
+#include "affinity.h"
+
+option<> conf_cpus      ("cpus",	0,	"Host CPUs for simulation threads, e.g. 0-7,16-23");
+option<> conf_placement ("placement",	0,	"Order of CPUs given to threads, packed or spread across NUMA nodes");
+option<> conf_helpercpus("helpercpus",	0,	"Host CPUs for status and other helper threads");
+
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<int> order;	// CPU for each slot
+static bool ordered;
+
+// "0-3,8,10-11" appended to cpus
+static void parse_cpulist(const char* list, std::vector<int>& cpus)
+{
+  const char* p = list;
+  while (*p) {
+    char* end;
+    long lo = strtol(p, &end, 10);
+    quitif(end==p, "Bad CPU list %s", list);
+    long hi = lo;
+    p = end;
+    if (*p == '-') {
+      hi = strtol(p+1, &end, 10);
+      quitif(end==p+1 || hi<lo, "Bad CPU list %s", list);
+      p = end;
+    }
+    for (long c=lo; c<=hi; c++)
+      cpus.push_back(c);
+    if (*p == ',')
+      p++;
+    else
+      quitif(*p, "Bad CPU list %s", list);
+  }
+}
+
+// NUMA node of each CPU from sysfs, all 0 if not available
+static std::vector<int> cpu_nodes()
+{
+  std::vector<int> node;
+  for (int n=0; ; n++) {
+    char fname[100];
+    snprintf(fname, sizeof fname, "/sys/devices/system/node/node%d/cpulist", n);
+    FILE* f = fopen(fname, "r");
+    if (!f)
+      break;
+    char buf[4096];
+    if (fgets(buf, sizeof buf, f)) {
+      buf[strcspn(buf, "\n")] = 0;
+      std::vector<int> cpus;
+      parse_cpulist(buf, cpus);
+      for (int c : cpus) {
+	if (c >= (int)node.size())
+	  node.resize(c+1, 0);
+	node[c] = n;
+      }
+    }
+    fclose(f);
+  }
+  return node;
+}
+
+static void make_order()
+{
+  std::vector<int> cpus;
+  if (conf_cpus())
+    parse_cpulist(conf_cpus(), cpus);
+  else {			// whatever the process was started with
+    cpu_set_t set;
+    dieif(sched_getaffinity(0, sizeof set, &set), "sched_getaffinity failed");
+    for (int c=0; c<CPU_SETSIZE; c++)
+      if (CPU_ISSET(c, &set))
+	cpus.push_back(c);
+  }
+  quitif(cpus.empty(), "No CPUs in --cpus=%s", conf_cpus());
+  std::vector<int> node = cpu_nodes();
+  int nodes = 1;
+  for (int c : cpus)
+    if (c < (int)node.size() && node[c]+1 > nodes)
+      nodes = node[c]+1;
+  std::vector< std::vector<int> > by_node(nodes);
+  for (int c : cpus)
+    by_node[c < (int)node.size() ? node[c] : 0].push_back(c);
+  const char* how = conf_placement() ? conf_placement() : "packed";
+  if (strcmp(how, "packed") == 0) {
+    for (auto& v : by_node)
+      order.insert(order.end(), v.begin(), v.end());
+  }
+  else if (strcmp(how, "spread") == 0) {
+    for (size_t k=0; order.size() < cpus.size(); k++)
+      for (auto& v : by_node)
+	if (k < v.size())
+	  order.push_back(v[k]);
+  }
+  else
+    quitif(true, "--placement must be packed or spread, not %s", how);
+}
+
+static void pin_to(const int* cpus, int n)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int k=0; k<n; k++)
+    CPU_SET(cpus[k], &set);
+  dieif(pthread_setaffinity_np(pthread_self(), sizeof set, &set), "cannot pin thread to CPU %d", cpus[0]);
+}
+
+void pin_thread(int slot)
+{
+  if (!conf_cpus() && !conf_placement())
+    return;
+  pthread_mutex_lock(&order_lock);
+  if (!ordered) {
+    make_order();
+    ordered = true;
+  }
+  int cpu = order[slot % order.size()];
+  pthread_mutex_unlock(&order_lock);
+  pin_to(&cpu, 1);
+}
+
+void pin_helper()
+{
+  if (!conf_helpercpus())
+    return;
+  std::vector<int> cpus;
+  parse_cpulist(conf_helpercpus(), cpus);
+  pin_to(cpus.data(), cpus.size());
+}
@@ -0,0 +1,20 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Pinning host threads to CPUs.  --cpus lists the CPUs simulation
+  threads may use, default all allowed.  --placement orders them:
+  packed fills one NUMA node before the next, spread alternates nodes.
+  Slot n (hart number, M:N worker or replay thread) is pinned to the
+  n-th CPU in that order, wrapping around.  Status and other helper
+  threads go on --helpercpus.  Memory a pinned thread touches first
+  is then allocated on its own node.
+*/
+
+extern option<> conf_cpus;
+extern option<> conf_placement;
+extern option<> conf_helpercpus;
+
+void pin_thread(int slot);	// calling thread, no-op unless --cpus or --placement
+void pin_helper();		// calling thread, no-op unless --helpercpus
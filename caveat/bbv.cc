@@ -0,0 +1,297 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <math.h>
+#include <float.h>
+#include <pthread.h>
+#include <vector>
+
+#include "caveat.h"
+#include "hart.h"
+#include "bbv.h"
+
+struct bbentry_t {
+  uint32_t number;		// block number
+  uint32_t count;		// instructions executed in interval
+};
+
+struct profiler_t {
+  profiler_t* next;		// list of all profilers for bbv_close()
+  char name[1024];		// without .bb suffix
+  FILE* f;
+  pthread_mutex_t lock;		// held while emitting an interval
+  bool closed;
+  long insns;			// in current interval
+  vector<uint32_t> counts;	// indexed by block number
+  vector<uint32_t> touched;	// block numbers with nonzero counts
+  vector< vector<bbentry_t> > intervals; // kept only for clustering
+  void emit();
+  void cluster(int kmax);
+};
+
+static const char* bbv_basename;
+static long bbv_interval;
+static int bbv_kmax;
+static profiler_t* profilers;
+static pthread_mutex_t profilers_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local profiler_t* me;
+
+void bbv_open(const char* basename, long interval, int kmax)
+{
+  dieif(interval<=0, "bbv interval %ld must be positive", interval);
+  bbv_basename = basename;
+  bbv_interval = interval;
+  bbv_kmax = kmax;
+}
+
+static profiler_t* new_profiler(hart_t* h)
+{
+  profiler_t* p = new profiler_t;
+  pthread_mutex_lock(&profilers_lock);
+  // first hart gets plain basename, clones get basename.tid
+  if (profilers)
+    snprintf(p->name, sizeof p->name, "%s.%d", bbv_basename, h->tid());
+  else
+    snprintf(p->name, sizeof p->name, "%s", bbv_basename);
+  char fname[1100];
+  snprintf(fname, sizeof fname, "%s.bb", p->name);
+  p->f = fopen(fname, "w");
+  quitif(!p->f, "Cannot open bbv file %s", fname);
+  p->next = profilers;
+  profilers = p;
+  pthread_mutex_unlock(&profilers_lock);
+  pthread_mutex_init(&p->lock, 0);
+  p->closed = false;
+  p->insns = 0;
+  return p;
+}
+
+void profiler_t::emit()
+{
+  if (touched.empty())
+    return;
+  fprintf(f, "T");
+  vector<bbentry_t>* v = 0;
+  if (bbv_kmax > 0) {
+    intervals.emplace_back();
+    v = &intervals.back();
+  }
+  for (uint32_t n : touched) {
+    fprintf(f, ":%u:%u ", n, counts[n]);
+    if (v)
+      v->push_back({n, counts[n]});
+    counts[n] = 0;
+  }
+  fprintf(f, "\n");
+  touched.clear();
+  insns = 0;
+}
+
+void bbv_profiler(hart_t* h, Header_t* bb, uintptr_t* ap)
+{
+  if (!me)
+    me = new_profiler(h);
+  profiler_t* p = me;
+  uint32_t n = bb->number;
+  quitif(n==0, "bbv profiling needs the basic block interpreter");
+  if (n >= p->counts.size())
+    p->counts.resize(n+1);
+  if (p->counts[n] == 0)
+    p->touched.push_back(n);
+  p->counts[n] += bb->count;
+  p->insns += bb->count;
+  if (p->insns >= bbv_interval) {
+    pthread_mutex_lock(&p->lock);
+    if (!p->closed)
+      p->emit();
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+
+/*
+  Built-in clustering follows SimPoint: normalize each interval vector,
+  randomly project to a few dimensions, run k-means for k=1..kmax and
+  pick the smallest k whose BIC score is within 90% of the best.  The
+  interval nearest each centroid is that cluster's simulation point.
+*/
+
+#define PROJDIM		15	// random projection dimensions
+#define KMEANS_SEEDS	5	// random initializations per k
+#define KMEANS_ITERS	100	// maximum iterations per run
+#define BIC_THRESHOLD	0.9	// fraction of BIC range
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15L;
+
+static double uniform()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (rng_state >> 11) * (1.0/(1L<<53));
+}
+
+static double dist2(const double* a, const double* b)
+{
+  double d = 0;
+  for (int j=0; j<PROJDIM; j++)
+    d += (a[j]-b[j])*(a[j]-b[j]);
+  return d;
+}
+
+// returns total squared distance, fills in assignment and centers
+static double kmeans(int k, const vector<double>& x, long R, vector<int>& assign, vector<double>& ctr)
+{
+  ctr.assign(k*PROJDIM, 0.0);
+  for (int c=0; c<k; c++) {	// random intervals as initial centers
+    long r = (long)(uniform()*R);
+    memcpy(&ctr[c*PROJDIM], &x[r*PROJDIM], PROJDIM*sizeof(double));
+  }
+  assign.assign(R, -1);
+  double total = 0;
+  for (int it=0; it<KMEANS_ITERS; it++) {
+    bool changed = false;
+    total = 0;
+    for (long r=0; r<R; r++) {
+      int best = 0;
+      double bestd = DBL_MAX;
+      for (int c=0; c<k; c++) {
+	double d = dist2(&x[r*PROJDIM], &ctr[c*PROJDIM]);
+	if (d < bestd) { bestd=d; best=c; }
+      }
+      if (assign[r] != best) { assign[r]=best; changed=true; }
+      total += bestd;
+    }
+    if (!changed)
+      break;
+    vector<long> size(k, 0);
+    ctr.assign(k*PROJDIM, 0.0);
+    for (long r=0; r<R; r++) {
+      size[assign[r]]++;
+      for (int j=0; j<PROJDIM; j++)
+	ctr[assign[r]*PROJDIM+j] += x[r*PROJDIM+j];
+    }
+    for (int c=0; c<k; c++) {
+      if (size[c] == 0) {	// reseed empty cluster
+	long r = (long)(uniform()*R);
+	memcpy(&ctr[c*PROJDIM], &x[r*PROJDIM], PROJDIM*sizeof(double));
+      }
+      else
+	for (int j=0; j<PROJDIM; j++)
+	  ctr[c*PROJDIM+j] /= size[c];
+    }
+  }
+  return total;
+}
+
+// Bayesian Information Criterion for spherical Gaussian clusters
+static double bic(int k, long R, const vector<int>& assign, double distortion)
+{
+  if (R <= k)
+    return -DBL_MAX;
+  vector<long> size(k, 0);
+  for (long r=0; r<R; r++)
+    size[assign[r]]++;
+  double variance = distortion / (R-k);
+  if (variance < 1e-300)
+    variance = 1e-300;
+  double loglik = 0;
+  for (int c=0; c<k; c++) {
+    double Rc = size[c];
+    if (Rc == 0)
+      continue;
+    loglik += Rc*log(Rc) - Rc*log((double)R) - Rc/2*log(2*M_PI) - Rc*PROJDIM/2*log(variance) - (Rc-k)/2;
+  }
+  double params = (k-1) + k*PROJDIM + 1;
+  return loglik - params/2*log((double)R);
+}
+
+void profiler_t::cluster(int kmax)
+{
+  long R = intervals.size();
+  if (R == 0)
+    return;
+  // random projection of normalized vectors, matrix generated lazily per block number
+  vector<double> proj;
+  vector<double> x(R*PROJDIM, 0.0);
+  for (long r=0; r<R; r++) {
+    double sum = 0;
+    for (bbentry_t& e : intervals[r])
+      sum += e.count;
+    for (bbentry_t& e : intervals[r]) {
+      while (proj.size() < (e.number+1)*PROJDIM)
+	proj.push_back(2*uniform()-1);
+      for (int j=0; j<PROJDIM; j++)
+	x[r*PROJDIM+j] += e.count/sum * proj[e.number*PROJDIM+j];
+    }
+  }
+  if (kmax > R)
+    kmax = R;
+  vector< vector<int> > assigns(kmax+1);
+  vector< vector<double> > centers(kmax+1);
+  vector<double> score(kmax+1);
+  double lo = DBL_MAX, hi = -DBL_MAX;
+  for (int k=1; k<=kmax; k++) {
+    double best = DBL_MAX;
+    for (int s=0; s<KMEANS_SEEDS; s++) {
+      vector<int> a;
+      vector<double> c;
+      double d = kmeans(k, x, R, a, c);
+      if (d < best) { best=d; assigns[k]=a; centers[k]=c; }
+    }
+    score[k] = bic(k, R, assigns[k], best);
+    if (score[k] == -DBL_MAX)
+      continue;
+    if (score[k] < lo) lo = score[k];
+    if (score[k] > hi) hi = score[k];
+  }
+  int k = 1;
+  while (k < kmax && !(score[k] != -DBL_MAX && score[k] >= lo + BIC_THRESHOLD*(hi-lo)))
+    k++;
+  // simulation point is interval closest to centroid
+  vector<long> point(k, -1);
+  vector<double> nearest(k, DBL_MAX);
+  vector<long> size(k, 0);
+  for (long r=0; r<R; r++) {
+    int c = assigns[k][r];
+    size[c]++;
+    double d = dist2(&x[r*PROJDIM], &centers[k][c*PROJDIM]);
+    if (d < nearest[c]) { nearest[c]=d; point[c]=r; }
+  }
+  char fname[1100];
+  snprintf(fname, sizeof fname, "%s.simpoints", name);
+  FILE* sp = fopen(fname, "w");
+  quitif(!sp, "Cannot open %s", fname);
+  snprintf(fname, sizeof fname, "%s.weights", name);
+  FILE* wt = fopen(fname, "w");
+  quitif(!wt, "Cannot open %s", fname);
+  for (int c=0, id=0; c<k; c++) {
+    if (size[c] == 0)
+      continue;
+    fprintf(sp, "%ld %d\n", point[c], id);
+    fprintf(wt, "%8.6f %d\n", (double)size[c]/R, id);
+    id++;
+  }
+  fclose(sp);
+  fclose(wt);
+  fprintf(stderr, "%s: %ld intervals in %d clusters\n", name, R, k);
+}
+
+void bbv_close()
+{
+  pthread_mutex_lock(&profilers_lock);
+  for (profiler_t* p=profilers; p; p=p->next) {
+    pthread_mutex_lock(&p->lock);
+    if (!p->closed) {
+      if (p == me)		// other harts may still be counting
+	p->emit();		// partial last interval
+      fclose(p->f);
+      p->closed = true;
+      if (bbv_kmax > 0)
+	p->cluster(bbv_kmax);
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+  pthread_mutex_unlock(&profilers_lock);
+}
@@ -0,0 +1,15 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Basic block vector profiling in the SimPoint format.  Every interval
+  instructions each hart writes one line
+    T:n:count :n:count ...
+  where n is the dense block number from Tcache_t and count is the
+  number of instructions executed in that block during the interval.
+*/
+
+void bbv_open(const char* basename, long interval, int kmax);
+void bbv_profiler(class hart_t* h, Header_t* bb, uintptr_t* ap);
+void bbv_close();		// also clusters if kmax > 0
@@ -0,0 +1,256 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "caveat.h"
+#include "hart.h"
+#include "symbols.h"
+#include "calls.h"
+
+option<bool>	conf_calls ("calls",	false, true,		"Shadow call stack profile of functions and call paths");
+option<>	conf_folded("folded",	"calls",		"File name prefix for --calls folded stacks");
+
+enum { Insns, Cycles, Event, Number_of_Metrics };
+
+struct node_t {
+  uint32_t parent;
+  uint32_t last_child;		// most recent callee, 0=none
+  uintptr_t func;		// entry address
+  long cost[Number_of_Metrics];	// exclusive
+};
+
+struct frame_t {
+  uint32_t node;
+  uintptr_t ret;		// expected return address
+  uintptr_t sp;			// at call
+};
+
+class shadow_t {
+public:
+  vector<node_t> nodes;		// calling context tree, 0 is root
+  map< pair<uint32_t, uintptr_t>, uint32_t > children;
+  vector<frame_t> stack;
+  long last[Number_of_Metrics];	// at end of previous block
+  void restart();		// root set by next block
+  uint32_t child(uint32_t parent, uintptr_t func);
+};
+
+static map< string, vector<long> > paths; // merged folded stacks
+static pthread_mutex_t paths_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void shadow_t::restart()
+{
+  nodes.clear();
+  children.clear();
+  stack.clear();
+  nodes.push_back({0, 0, 0, {0}});
+  stack.push_back({0, 0, UINTPTR_MAX});
+}
+
+uint32_t shadow_t::child(uint32_t parent, uintptr_t func)
+{
+  uint32_t c = nodes[parent].last_child;
+  if (c && nodes[c].func == func)
+    return c;
+  auto it = children.find({parent, func});
+  if (it != children.end())
+    c = it->second;
+  else {
+    c = nodes.size();
+    nodes.push_back({parent, 0, func, {0}});
+    children[{parent, func}] = c;
+  }
+  nodes[parent].last_child = c;
+  return c;
+}
+
+shadow_t* shadow_new(hart_t* h)
+{
+  shadow_t* s = new shadow_t;
+  s->restart();
+  return s;
+}
+
+static bool link_reg(int r) { return r==1 || r==5; } // ra or t0
+
+void shadow_block(hart_t* h, Header_t* bb)
+{
+  shadow_t* s = h->shadow;
+  long now[Number_of_Metrics] = { h->executed(), h->cycle_count(), h->hpm_count(0) };
+  if (s->nodes[0].func == 0) {	// first block of new or reused hart
+    s->nodes[0].func = bb->addr;
+    memcpy(s->last, now, sizeof now);
+    s->last[Insns] -= bb->count;
+  }
+  long* cost = s->nodes[s->stack.back().node].cost;
+  for (int m=0; m<Number_of_Metrics; m++) {
+    cost[m] += now[m]>=s->last[m] ? now[m]-s->last[m] : now[m]; // counters may be cleared
+    s->last[m] = now[m];
+  }
+  const Insn_t* i = insnp(bb+1) + bb->count-1;
+  uintptr_t sp = h->s.xrf[2];
+  bool ret = false;
+  switch (i->opcode()) {
+  case Op_jal:
+  case Op_jalr:
+  case Op_c_jalr:
+    if (link_reg(i->rd())) {
+      uint32_t n = s->child(s->stack.back().node, h->pc);
+      s->stack.push_back({n, (uintptr_t)h->s.xrf[i->rd()], sp}); // link register holds return address
+      return;
+    }
+    if (i->opcode() == Op_jal)
+      return;
+    ret = link_reg(i->rs1());	// jalr x0
+    break;
+  case Op_c_ret:
+    ret = true;
+    break;
+  case Op_ret:
+  case Op_c_jr:
+    ret = link_reg(i->rs1());
+    break;
+  default:
+    return;
+  }
+  // frames called from below current stack pointer are gone
+  while (s->stack.size() > 1 && s->stack.back().sp < sp)
+    s->stack.pop_back();
+  if (ret && s->stack.size() > 1 && s->stack.back().ret == h->pc)
+    s->stack.pop_back();
+}
+
+static string func_name(uintptr_t func)
+{
+  long offset = 0;
+  const char* name = find_symbol(func, &offset);
+  char buf[64];
+  if (!name) {
+    snprintf(buf, sizeof buf, "0x%lx", func);
+    return buf;
+  }
+  if (offset == 0)
+    return name;
+  snprintf(buf, sizeof buf, "+%ld", offset);
+  return string(name) + buf;
+}
+
+// add costs to merged call paths and zero them
+static void fold(shadow_t* s)
+{
+  vector<string> path(s->nodes.size());	// parents come before children
+  pthread_mutex_lock(&paths_lock);
+  for (uint32_t k=0; k<s->nodes.size(); k++) {
+    node_t* n = &s->nodes[k];
+    path[k] = k==0 ? func_name(n->func) : path[n->parent] + ";" + func_name(n->func);
+    if (n->cost[Insns]==0 && n->cost[Cycles]==0 && n->cost[Event]==0)
+      continue;
+    vector<long>& p = paths[path[k]];
+    p.resize(Number_of_Metrics);
+    for (int m=0; m<Number_of_Metrics; m++) {
+      p[m] += n->cost[m];
+      n->cost[m] = 0;
+    }
+  }
+  pthread_mutex_unlock(&paths_lock);
+}
+
+void shadow_retire(hart_t* h)
+{
+  fold(h->shadow);
+  h->shadow->restart();
+}
+
+static void write_folded(const char* suffix, int m)
+{
+  char name[1024];
+  snprintf(name, sizeof name, "%s.%s", conf_folded(), suffix);
+  FILE* f = fopen(name, "w");
+  quitif(!f, "Cannot open folded stacks file %s", name);
+  for (auto& p : paths)
+    if (p.second[m])
+      fprintf(f, "%s %ld\n", p.first.c_str(), p.second[m]);
+  fclose(f);
+}
+
+struct function_cost_t {
+  string name;
+  long incl[Number_of_Metrics], excl[Number_of_Metrics];
+};
+
+void calls_report(FILE* f)
+{
+  bool timed = false;
+  hart_t::begin_walk();
+  for (hart_t* p=hart_t::list(); p; p=p->next()) {
+    if (p->cycles)
+      timed = true;
+    if (p->shadow)
+      fold(p->shadow);
+  }
+  hart_t::end_walk();
+  const char* event = conf_hpm();
+  int event_len = event ? strcspn(event, ",") : 0;
+
+  // inclusive cost counts a function once per path however deep its recursion
+  map<string, function_cost_t> fns;
+  long total = 0;
+  for (auto& p : paths) {
+    vector<string> seen;
+    size_t b = 0;
+    for (;;) {
+      size_t e = p.first.find(';', b);
+      string name = p.first.substr(b, e==string::npos ? string::npos : e-b);
+      function_cost_t& fc = fns[name];
+      fc.name = name;
+      if (find(seen.begin(), seen.end(), name) == seen.end()) {
+	seen.push_back(name);
+	for (int m=0; m<Number_of_Metrics; m++)
+	  fc.incl[m] += p.second[m];
+      }
+      if (e == string::npos) {
+	for (int m=0; m<Number_of_Metrics; m++)
+	  fc.excl[m] += p.second[m];
+	break;
+      }
+      b = e+1;
+    }
+    total += p.second[Insns];
+  }
+  if (total == 0)
+    return;
+
+  write_folded("insns", Insns);
+  if (timed)
+    write_folded("cycles", Cycles);
+  if (event_len)
+    write_folded(string(event, event_len).c_str(), Event);
+  vector<function_cost_t*> v;
+  for (auto& e : fns)
+    v.push_back(&e.second);
+  sort(v.begin(), v.end(), [](function_cost_t* a, function_cost_t* b) { return a->incl[Insns] > b->incl[Insns]; });
+  fprintf(f, "\nCall profile of %ld instructions, %ld call paths in %s.insns\n", total, paths.size(), conf_folded());
+  fprintf(f, "%7s %14s %14s", "incl%", "inclusive", "exclusive");
+  if (timed)
+    fprintf(f, " %14s %14s", "incl cycles", "excl cycles");
+  if (event_len) {
+    string e(event, event_len);
+    fprintf(f, " %14s %14s", (e+" incl").c_str(), (e+" excl").c_str());
+  }
+  fprintf(f, "  function\n");
+  for (int k=0; k<v.size() && k<30; k++) {
+    function_cost_t* fc = v[k];
+    fprintf(f, "%6.2f%% %14ld %14ld", 100.0*fc->incl[Insns]/total, fc->incl[Insns], fc->excl[Insns]);
+    if (timed)
+      fprintf(f, " %14ld %14ld", fc->incl[Cycles], fc->excl[Cycles]);
+    if (event_len)
+      fprintf(f, " %14ld %14ld", fc->incl[Event], fc->excl[Event]);
+    fprintf(f, "  %s\n", fc->name.c_str());
+  }
+}
@@ -0,0 +1,29 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Shadow call stack profiler for --calls.  After every basic block the
+  interpreter charges the instructions, cycles and first --hpm event
+  since the previous block to the function on top of the hart's shadow
+  stack, a node in its calling context tree.  A block ending in jal or
+  jalr linking ra (or t0) pushes the target, a return pops.
+
+  Returns are matched against the return address expected by each
+  frame.  Every frame also remembers the stack pointer at its call, so
+  a longjmp or an exception landing pad, which restores sp, discards
+  the frames below it.  Tail calls are charged to the function that
+  made them.
+
+  At exit the trees of all harts are merged by call path, printed as
+  inclusive and exclusive costs per function and written as folded
+  stacks ("main;foo;bar count" lines) for flame graph tools.
+*/
+
+extern option<bool> conf_calls;
+extern option<> conf_folded;
+
+class shadow_t* shadow_new(class hart_t* h);
+void shadow_block(class hart_t* h, Header_t* bb); // after block executed
+void shadow_retire(class hart_t* h);		   // merge costs, restart stack
+void calls_report(FILE* f);
@@ -84,7 +84,10 @@ struct alignas(8) Header_t {
   unsigned count	:  7;	// number of instructions
   unsigned length	:  8;	// number of 16-bit parcels
   unsigned pad		: 16;
-  uint32_t link;		// offset to next hash table entry
+  union {
+    uint32_t link;		// offset to next hash table entry
+    uint32_t number;		// dense index of block in its Tcache_t, 0=not cached
+  };
   Header_t(uintptr_t a, unsigned l, unsigned c, bool p) { addr=a; length=l; count=c; conditional=p; link=0; }
 };
 static_assert(sizeof(Header_t) == 16);
@@ -106,18 +109,45 @@ static inline Header_t* bbptr(Insn_t*   p) { return (Header_t*)p; }
 #ifndef OLD_TCACHE
 
 #include <map>
+#include <vector>
 using namespace std;
 
+/*
+  Each block also has an entry counter, indexed by its number, bumped
+  by the interpreter.  Only the owning hart adds blocks and counts, the
+  lock lets another thread harvest the counters while it runs.
+*/
 class Tcache_t {
   map<uintptr_t, Header_t*> table;
+  uint32_t _blocks;		// number of blocks added so far
+  vector<long> _entries;	// times each block was entered
+  pthread_mutex_t lock;		// held adding blocks and harvesting
 public:
+  Tcache_t() { _blocks=0; _entries.resize(1024); pthread_mutex_init(&lock, 0); }
   Header_t* find(uintptr_t pc) { auto it=table.find(pc); return it==table.end() ? 0 : it->second; }
   Header_t* add(Header_t* wbb, size_t n) {
     Header_t* bb = (Header_t*)new uint64_t[n];
     memcpy(bb, wbb, n*sizeof(uint64_t));
+    pthread_mutex_lock(&lock);
+    bb->number = ++_blocks;	// blocks are numbered densely from 1
+    if (_blocks >= _entries.size())
+      _entries.resize(2*_entries.size());
     table.insert({bb->addr, bb});
+    pthread_mutex_unlock(&lock);
     return bb;
   }
+  void enter(Header_t* bb) { _entries[bb->number]++; }
+  // f(bb, entries) for every entered block, counters restart from zero
+  template<class F> void harvest(F f) {
+    pthread_mutex_lock(&lock);
+    for (auto& e : table)
+      if (long n = _entries[e.second->number]) {
+	_entries[e.second->number] -= n;
+	f(e.second, n);
+      }
+    pthread_mutex_unlock(&lock);
+  }
+  size_t blocks() { return _blocks; }
   size_t flushed() { return 0; }
 };
 
@@ -191,6 +221,10 @@ typedef void (*simfunc_t)(class hart_t* h, Header_t* bb, uintptr_t* ap);
 typedef long (*syscallfunc_t)(class hart_t* h, long a0);
 typedef int (*clonefunc_t)(class hart_t* h);
 typedef void (*interpreterfunc_t)(class hart_t* h);
+typedef bool (*eventfunc_t)(class hart_t* h);
+typedef void (*roifunc_t)(class hart_t* h, int what);
+typedef long (*cyclefunc_t)(class hart_t* h);
+typedef long (*counterfunc_t)(class hart_t* h, int event);
 
 
 void start_time();
@@ -0,0 +1,186 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <unordered_map>
+#include <vector>
+
+#include "caveat.h"
+#include "hart.h"
+#include "region.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+option<long> conf_checkpoint("checkpoint-at", 0,		"Write checkpoint after this many instructions");
+option<>     conf_ckptfile  ("ckptfile",	"caveat.ckpt",	"Checkpoint file name");
+option<>     conf_restore   ("restore",		0,		"Resume from checkpoint file instead of loading program");
+
+// in loader.cc
+void save_loader_state(FILE* f);
+void restore_loader_state(FILE* f);
+
+/*
+  Checkpoint file is
+
+    checkpoint_header_t
+    loader state
+    processor_state_t, pc
+    region_t[regions]
+    page_ref_t[refs]	one for each nonzero page
+    padding to page boundary
+    unique page contents
+
+  All-zero pages are omitted and identical pages are stored once.
+*/
+
+#define CKPT_MAGIC	0x74706b6361766163L	// "cavackpt"
+#define CKPT_VERSION	1
+#define CKPT_PGSIZE	4096
+
+struct checkpoint_header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t harts;		// must be 1
+  long executed;		// instructions executed when written
+  uint64_t regions;
+  uint64_t refs;
+  uint64_t pages;
+  uint64_t pool;		// file offset of page contents
+};
+
+struct page_ref_t {
+  uintptr_t addr;
+  uint64_t page;		// index into page contents
+};
+
+static bool zero_page(const uint64_t* p)
+{
+  uint64_t any = 0;
+  for (int k=0; k<CKPT_PGSIZE/8; k++)
+    any |= p[k];
+  return any == 0;
+}
+
+static uint64_t hash_page(const uint64_t* p)
+{
+  uint64_t h = 0xcbf29ce484222325L;
+  for (int k=0; k<CKPT_PGSIZE/8; k++)
+    h = (h ^ p[k]) * 0x100000001b3L;
+  return h;
+}
+
+void write_checkpoint(const char* filename, hart_t* h)
+{
+#ifdef SPIKE
+  die("Checkpoint not supported with Spike processor state");
+#endif
+  quitif(hart_t::num_harts()>1, "Checkpoint of multithreaded guest not supported");
+  vector<region_t> regions = region_list();
+  vector<page_ref_t> refs;
+  vector<const uint64_t*> pages;
+  unordered_multimap<uint64_t, uint64_t> seen; // hash -> page index
+  unsigned char resident[1024];
+  for (region_t& r : regions) {
+    if (!(r.prot & PROT_READ))
+      continue;
+    for (uintptr_t a=r.begin; a<r.end; a+=CKPT_PGSIZE) {
+      // untouched anonymous memory is zero, skip without reading it
+      if (r.anonymous && (a-r.begin) % (sizeof resident*CKPT_PGSIZE) == 0) {
+	size_t len = r.end-a < sizeof resident*CKPT_PGSIZE ? r.end-a : sizeof resident*CKPT_PGSIZE;
+	if (mincore((void*)a, len, resident) != 0)
+	  memset(resident, 1, sizeof resident);
+      }
+      if (r.anonymous && !(resident[(a-r.begin)/CKPT_PGSIZE % sizeof resident] & 1))
+	continue;
+      const uint64_t* p = (const uint64_t*)a;
+      if (zero_page(p))
+	continue;
+      uint64_t hv = hash_page(p);
+      uint64_t index = pages.size();
+      auto range = seen.equal_range(hv);
+      for (auto it=range.first; it!=range.second; ++it)
+	if (memcmp(pages[it->second], p, CKPT_PGSIZE) == 0) {
+	  index = it->second;
+	  break;
+	}
+      if (index == pages.size()) {
+	pages.push_back(p);
+	seen.insert({hv, index});
+      }
+      refs.push_back({a, index});
+    }
+  }
+
+  FILE* f = fopen(filename, "w");
+  quitif(!f, "Cannot open checkpoint file %s", filename);
+  checkpoint_header_t ch;
+  memset(&ch, 0, sizeof ch);
+  ch.magic = CKPT_MAGIC;
+  ch.version = CKPT_VERSION;
+  ch.harts = 1;
+  ch.executed = h->executed();
+  ch.regions = regions.size();
+  ch.refs = refs.size();
+  ch.pages = pages.size();
+  fwrite(&ch, sizeof ch, 1, f);
+  save_loader_state(f);
+  fwrite(&h->s, sizeof h->s, 1, f);
+  fwrite(&h->pc, sizeof h->pc, 1, f);
+  fwrite(regions.data(), sizeof(region_t), regions.size(), f);
+  fwrite(refs.data(), sizeof(page_ref_t), refs.size(), f);
+  ch.pool = (ftell(f)+CKPT_PGSIZE-1) & ~(CKPT_PGSIZE-1L);
+  fseek(f, ch.pool, SEEK_SET);
+  for (const uint64_t* p : pages)
+    dieif(fwrite(p, CKPT_PGSIZE, 1, f)!=1, "write checkpoint %s failed", filename);
+  fseek(f, 0, SEEK_SET);
+  fwrite(&ch, sizeof ch, 1, f);
+  fclose(f);
+  fprintf(stderr, "Checkpoint %s at %ld insns: %ld regions, %ld pages, %ld unique\n",
+	  filename, ch.executed, ch.regions, ch.refs, ch.pages);
+}
+
+bool checkpoint_event(hart_t* h)
+{
+  h->event_at = LONG_MAX;
+  write_checkpoint(conf_ckptfile(), h);
+  return false;
+}
+
+void restore_checkpoint(const char* filename, hart_t* h)
+{
+#ifdef SPIKE
+  die("Checkpoint not supported with Spike processor state");
+#endif
+  FILE* f = fopen(filename, "r");
+  quitif(!f, "Cannot open checkpoint file %s", filename);
+  checkpoint_header_t ch;
+  quitif(fread(&ch, sizeof ch, 1, f)!=1 || ch.magic!=CKPT_MAGIC || ch.version!=CKPT_VERSION,
+	 "%s is not a checkpoint file", filename);
+  quitif(ch.harts!=1, "Checkpoint %s has %d harts, only 1 supported", filename, ch.harts);
+  restore_loader_state(f);
+  dieif(fread(&h->s, sizeof h->s, 1, f)!=1, "read checkpoint state failed");
+  dieif(fread(&h->pc, sizeof h->pc, 1, f)!=1, "read checkpoint pc failed");
+  vector<region_t> regions(ch.regions);
+  dieif(fread(regions.data(), sizeof(region_t), ch.regions, f)!=ch.regions, "read checkpoint regions failed");
+  vector<page_ref_t> refs(ch.refs);
+  dieif(fread(refs.data(), sizeof(page_ref_t), ch.refs, f)!=ch.refs, "read checkpoint pages failed");
+  for (region_t& r : regions) {
+    void* m = mmap((void*)r.begin, r.end-r.begin, PROT_READ|PROT_WRITE, MAP_FIXED_NOREPLACE|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    quitif(m!=(void*)r.begin, "Checkpoint %s region %lx-%lx already in use", filename, r.begin, r.end);
+    region_add(r.begin, r.end, r.prot, r.anonymous, r.kind);
+  }
+  int fd = fileno(f);
+  for (page_ref_t& p : refs)
+    dieif(pread(fd, (void*)p.addr, CKPT_PGSIZE, ch.pool+p.page*CKPT_PGSIZE)!=CKPT_PGSIZE,
+	  "read checkpoint page %lx failed", p.addr);
+  for (region_t& r : regions)
+    if (r.prot != (PROT_READ|PROT_WRITE))
+      mprotect((void*)r.begin, r.end-r.begin, r.prot);
+  fclose(f);
+  fprintf(stderr, "Restored %s at %ld insns\n", filename, ch.executed);
+}
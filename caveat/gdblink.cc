@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -428,6 +429,9 @@ ProcessGdbCommand() {
 	long addr;		// Beginning address.
 	long length;		// Number of bytes.
 	if (RcvHexInt(&addr) && *inPtr++ == ',' && RcvHexInt(&length) && *inPtr++ == ':') {
+	  // text is mapped read-only from the ELF file
+	  long page = addr & ~4095L;
+	  mprotect((void*)page, addr+length-page, PROT_READ|PROT_WRITE|PROT_EXEC);
 	  if (RcvHexToMemory((char*)addr, length)) {
 	    Reply("OK");
 	  }
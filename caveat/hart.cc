@@ -2,11 +2,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <pthread.h>
 
 #include "caveat.h"
 #include "hart.h"
+#include "record.h"
+#include "affinity.h"
+#include "symbols.h"
+#include "profile.h"
+#include "calls.h"
 
 extern "C" {
 #include "specialize.h"
@@ -18,46 +24,114 @@ option<size_t>	conf_tcache("tcache",	1000000L,		"Binary translation cache size")
 option<size_t>	conf_hash  ("hash",	997L,			"Hash table size, best if prime number");
 option<bool>	conf_show  ("show",	false, true,		"Show instruction trace");
 option<>	conf_gdb   ("gdb",	0, "localhost:1234",	"Remote GDB connection");
-option<bool>	conf_calls ("calls",	false, true,		"Show function calls and returns");
+option<bool>	conf_srcline("srcline",	false, true,		"Show source file:line in instruction trace");
+option<bool>	conf_roi   ("roi",	false, true,		"Simulate in detail only between ROI markers");
+option<>	conf_hpm   ("hpm",	0,			"Timing model events counted by hpmcounter3,4,... comma separated");
+extern option<long> conf_checkpoint;	// in checkpoint.cc
 
 // in loader.cc
 long emulate_execve(const char* filename, int argc, const char* argv[], const char* envp[], uintptr_t& pc);
 
 hart_t* hart_t::_list =0;
+hart_t* hart_t::_pool =0;
+volatile int hart_t::_walkers =0;
 int hart_t::_num_harts =0;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  Thread ID registry is a two-level table covering Linux tids and the
+  virtual tids of M:N scheduled harts.  Pages are allocated on first use
+  and never freed, so lookups need no lock.
+*/
+#define TID_PAGE_BITS	12
+#define TID_PAGES	(1<<11)		// tids below 1<<23
+static hart_t** volatile tid_table[TID_PAGES];
+
+static hart_t** tid_slot(int tid, bool create)
+{
+  if (tid <= 0 || tid >= TID_PAGES<<TID_PAGE_BITS)
+    return 0;
+  hart_t** page = tid_table[tid >> TID_PAGE_BITS];
+  if (!page && create) {
+    hart_t** fresh = new hart_t*[1<<TID_PAGE_BITS];
+    memset(fresh, 0, sizeof(hart_t*)<<TID_PAGE_BITS);
+    if (__sync_bool_compare_and_swap(&tid_table[tid >> TID_PAGE_BITS], 0, fresh))
+      page = fresh;
+    else {
+      delete[] fresh;
+      page = tid_table[tid >> TID_PAGE_BITS];
+    }
+  }
+  return page ? &page[tid & ((1<<TID_PAGE_BITS)-1)] : 0;
+}
 
 hart_t* hart_t::find(int tid)
 {
-  for (hart_t* p=_list; p; p=p->_next)
-    if (p->tid() == tid)
-      return (hart_t*)p;
-  return 0;
+  hart_t** slot = tid_slot(tid, false);
+  return slot ? *slot : 0;
+}
+
+void hart_t::set_tid(int tid)
+{
+  hart_t** slot = tid_slot(_tid, false);
+  if (slot && *slot == this)
+    *slot = 0;
+  _tid = tid;
+  slot = tid_slot(tid, true);
+  dieif(tid>0 && !slot, "tid %d too large for registry", tid);
+  if (slot)
+    *slot = this;
 }
 
 void hart_t::initialize()
 {
-  do {  // atomically attach to list of strands
-    _next = _list;
-  } while (!__sync_bool_compare_and_swap(&_list, _next, this));
+  pthread_mutex_lock(&list_lock); // attach to list of strands
+  _next = _list;
+  _list = this;
+  pthread_mutex_unlock(&list_lock);
   sid = __sync_fetch_and_add(&_num_harts, 1);
+  clear_child_tid = 0;
+  stats.executed = 0;
+  stats.syscalls = 0;
+  stats.syscall_ns = 0;
+  event_at = LONG_MAX;
+  event = 0;
+  yield_at = LONG_MAX;
+  sleep_cycles = 0;
+  shadow = conf_calls() ? shadow_new(this) : 0;
 }
 
 hart_t::hart_t(int argc, const char* argv[], const char* envp[])
 {
+  pin_thread(0);		// before main hart touches any memory
   memset(&s, 0, sizeof(processor_state_t));
-  uintptr_t stack_pointer = emulate_execve(argv[0], argc, argv, envp, pc);
+  if (conf_restore())
+    restore_checkpoint(conf_restore(), this);
+  else {
+    uintptr_t stack_pointer = emulate_execve(argv[0], argc, argv, envp, pc);
 #ifdef SPIKE
-  WRITE_REG(2, stack_pointer);
+    WRITE_REG(2, stack_pointer);
 #else
-  s.xrf[2] = stack_pointer;
+    s.xrf[2] = stack_pointer;
 #endif
-  _tid = gettid();
+  }
+  _tid = 0;
+  set_tid(gettid());
   ptnum = pthread_self();
   simulator = 0;		// must be filled in by deriving class
   clone = 0;			// same
   interpreter = 0;
   riscv_syscall = 0;
+  roi = 0;
+  cycles = 0;
+  counter = 0;
   initialize(); // do at end because there are atomic stuff in initialize()
+  if (conf_record() || conf_playback())
+    record_open();
+  if (conf_checkpoint()) {
+    event_at = conf_checkpoint();
+    event = checkpoint_event;
+  }
 }
 
 hart_t::hart_t(hart_t* from)
@@ -68,6 +142,27 @@ hart_t::hart_t(hart_t* from)
   clone = from->clone;
   interpreter = from->interpreter;
   riscv_syscall = from->riscv_syscall;
+  roi = from->roi;
+  cycles = from->cycles;
+  counter = from->counter;
+  _tid = 0;			// set when thread starts
+  initialize();
+}
+
+hart_t::hart_t()
+{
+  memset(&s, 0, sizeof(processor_state_t));
+  pc = 0;
+  _tid = 0;
+  set_tid(gettid());
+  ptnum = pthread_self();
+  simulator = 0;
+  clone = 0;
+  interpreter = 0;
+  riscv_syscall = 0;
+  roi = 0;
+  cycles = 0;
+  counter = 0;
   initialize();
 }
 
@@ -75,8 +170,65 @@ hart_t::~hart_t()
 {
 }
 
+void hart_t::retire()
+{
+  if (conf_profile())		// counts outlive the hart
+    profile_harvest(&tcache);
+  if (shadow)
+    shadow_retire(this);
+  hart_t** slot = tid_slot(_tid, false);
+  if (slot && *slot == this)
+    *slot = 0;
+  pthread_mutex_lock(&list_lock);
+  hart_t** pp = &_list;
+  while (*pp != this)
+    pp = &(*pp)->_next;
+  *pp = _next;			// walkers already here still see rest of list
+  _next = _pool;
+  _pool = this;
+  pthread_mutex_unlock(&list_lock);
+}
+
+hart_t* hart_t::reuse(hart_t* from)
+{
+  pthread_mutex_lock(&list_lock);
+  hart_t* h = _walkers==0 ? _pool : 0;
+  if (h) {
+    _pool = h->_next;
+    memcpy(&h->s, &from->s, sizeof(processor_state_t));
+    h->pc = from->pc;
+    h->simulator = from->simulator;
+    h->clone = from->clone;
+    h->interpreter = from->interpreter;
+    h->riscv_syscall = from->riscv_syscall;
+    h->roi = from->roi;
+    h->event_at = LONG_MAX;
+    h->event = 0;
+    h->yield_at = LONG_MAX;
+    h->cycles = from->cycles;
+    h->counter = from->counter;
+    h->sleep_cycles = 0;
+    h->clear_child_tid = 0;
+    h->debug.cursor = 0;
+    h->_next = _list;		// tcache and statistics are kept
+    _list = h;
+  }
+  pthread_mutex_unlock(&list_lock);
+  return h;
+}
+
 void hart_t::print(uintptr_t pc, Insn_t* i, FILE* out)
 {
+  if (conf_srcline()) {		// when source line changes
+    static thread_local const char* last_file;
+    static thread_local int last_line;
+    int line;
+    const char* file = find_line(pc, &line);
+    if (file && (file != last_file || line != last_line))
+      fprintf(out, "[%d] %s:%d\n", gettid(), file, line);
+    last_file = file;
+    last_line = line;
+  }
   fprintf(out, "[%d] ", gettid());
   if (i->rd() == NOREG) {
     if (attributes[i->opcode()] & ATTR_st)
@@ -103,6 +255,37 @@ void hart_t::print(uintptr_t pc, Insn_t* i, FILE* out)
 #define state s
 #endif
 
+/*
+  Timing models name their events and set hart_t::counter.  Mapping is
+  resolved once so reading an hpmcounter is a table lookup and a call.
+*/
+int hpm_event[HPM_COUNTERS] = { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+				-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 };
+
+void hpm_events(const char* names[])
+{
+  if (!conf_hpm())
+    return;
+  char buf[1024];
+  strncpy(buf, conf_hpm(), sizeof buf-1);
+  buf[sizeof buf-1] = 0;
+  int n = 0;
+  for (char* tok=strtok(buf, ","); tok; tok=strtok(0, ","), n++) {
+    quitif(n >= HPM_COUNTERS, "--hpm has more than %d events", HPM_COUNTERS);
+    int e = 0;
+    while (names[e] && strcmp(names[e], tok) != 0)
+      e++;
+    if (!names[e]) {
+      fprintf(stderr, "Unknown --hpm event %s, choose from", tok);
+      for (e=0; names[e]; e++)
+	fprintf(stderr, " %s", names[e]);
+      fprintf(stderr, "\n");
+      exit(-1);
+    }
+    hpm_event[n] = e;
+  }
+}
+
 reg_t hart_t::get_csr(int which, insn_t insn, bool write, bool peek)
 {
   switch (which) {
@@ -112,6 +295,14 @@ reg_t hart_t::get_csr(int which, insn_t insn, bool write, bool peek)
     return state.frm;
   case CSR_FCSR:
     return (state.fflags << FSR_AEXC_SHIFT) | (state.frm << FSR_RD_SHIFT);
+  case CSR_CYCLE:
+    return cycle_count();
+  case CSR_TIME:
+    return guest_monotonic_ns(this) / (1000000000/TIMEBASE_HZ);
+  case CSR_INSTRET:
+    return executed();
+  case CSR_HPMCOUNTER3 ... CSR_HPMCOUNTER31:
+    return hpm_count(which-CSR_HPMCOUNTER3);
 #ifdef SPIKE
   case CSR_VCSR:
     return (p->VU.vxsat << VCSR_VXSAT_SHIFT) | (p->VU.vxrm << VCSR_VXRM_SHIFT);
@@ -145,6 +336,11 @@ void hart_t::set_csr(int which, reg_t val)
     p->VU.vxrm = (val & VCSR_VXRM) >> VCSR_VXRM_SHIFT;
     break;
 #endif
+  case CSR_CYCLE:		// read-only counters, csr_func() always writes back
+  case CSR_TIME:
+  case CSR_INSTRET:
+  case CSR_HPMCOUNTER3 ... CSR_HPMCOUNTER31:
+    break;
   default:
     die("set_csr bad number");
   }
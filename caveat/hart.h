@@ -9,6 +9,24 @@ extern "C" {
 
 extern option<> conf_gdb;
 extern option<bool> conf_show;
+extern option<> conf_restore;
+extern option<bool> conf_roi;
+extern option<bool> conf_sysprof;
+extern option<> conf_hpm;
+
+#define HPM_COUNTERS	29	// hpmcounter3..31
+extern int hpm_event[HPM_COUNTERS]; // timing model event number, -1=reads zero
+void hpm_events(const char* names[]); // map --hpm names, list ends with 0
+
+#define ROI_BEGIN	1	// immediate field of roi_begin marker
+#define ROI_END		2	// immediate field of roi_end marker
+
+#define TIMEBASE_HZ	10000000	// frequency of time CSR, same as QEMU virt
+
+// in record.cc, order of atomic memory operations for --record and --playback
+extern bool sequenced;
+void sequence_begin(class hart_t* h);
+void sequence_end(class hart_t* h);
 
 
 struct pctrace_t {
@@ -93,6 +111,11 @@ struct insn_t {
 #define CSR_FFLAGS 0x1
 #define CSR_FRM 0x2
 #define CSR_FCSR 0x3
+#define CSR_CYCLE 0xc00
+#define CSR_TIME 0xc01
+#define CSR_INSTRET 0xc02
+#define CSR_HPMCOUNTER3 0xc03
+#define CSR_HPMCOUNTER31 0xc1f
 
 #define FP_RD_NE  0
 #define FP_RD_0   1
@@ -121,15 +144,25 @@ struct insn_t {
 
 
 
+// written only by the running hart, read by status thread: keep on own cache line
+struct alignas(64) hart_stats_t {
+  long executed;		// number of instructions
+  long syscalls;		// with --sysprof
+  long syscall_ns;		// host time in system calls
+};
+
 class hart_t {
   static int _num_harts;	// how many have been cloned
   static hart_t* _list;		// for find() using thread id
+  static hart_t* _pool;		// exited harts kept for reuse, linked by _next
+  static volatile int _walkers;	// threads traversing _list
   hart_t* _next;		// list of hart_t
   int sid;			// strand index number
   int _tid;			// Linux thread number
   pthread_t ptnum;		// pthread handle
   
   void initialize();		// used by constructor functions
+  void set_tid(int tid);	// also updates find() registry
 
   friend void controlled_by_gdb(const char* host_port, hart_t* cpu);
   friend void thread_interpreter(hart_t* me);
@@ -139,7 +172,7 @@ class hart_t {
     
 public:
   processor_state_t s;
-  long _executed;		// number of instructions
+  hart_stats_t stats;
 #ifdef SPIKE
   processor_t* p = &s.spike_cpu;
   reg_t& pc = s.spike_cpu.get_state()->pc;
@@ -157,25 +190,46 @@ public:
   clonefunc_t clone;		// function pointer just for clone system call
   interpreterfunc_t interpreter;// function pointer for interpreter
   syscallfunc_t riscv_syscall;	// function pointer for system calls
+  long event_at;		// call event() when executed() reaches this
+  eventfunc_t event;		// returns true to leave interpreter
+  roifunc_t roi;		// function pointer for region of interest markers
+  long yield_at;		// M:N scheduler switches harts when executed() reaches this
+  cyclefunc_t cycles;		// timing model cycle count, 0=one per instruction
+  counterfunc_t counter;	// timing model event count for hpmcounters
+  long sleep_cycles;		// simulated time spent in nanosleep
+  uintptr_t clear_child_tid;	// zero and futex wake at thread exit, 0=none
+  class shadow_t* shadow;	// --calls shadow call stack, 0=off
   
   hart_t(int argc, const char* argv[], const char* envp[]);
   hart_t(hart_t* p);
+  hart_t();			// no guest process, e.g. for trace replay
   ~hart_t();
 
   Header_t* find_bb(uintptr_t pc);
   void default_interpreter();
   bool single_step();
   void print(uintptr_t pc, Insn_t* i, FILE* out =stderr);
-  long executed() { return _executed; }
-  void count_insn(int n =1) { _executed += n; }
+  long executed() { return stats.executed; }
+  long cycle_count() { return cycles ? cycles(this) : executed(); }
+  long hpm_count(int n) { return hpm_event[n] < 0 ? 0 : counter(this, hpm_event[n]); }
+  void count_insn(int n =1) { stats.executed += n; }
+  void roi_marker(int what) { if (roi) roi(this, what); }
+  void clear_executed() { stats.executed = 0; }
   long flushed() { return tcache.flushed(); }
   void debug_print() { debug.print(); }
 
   static hart_t* list() { return _list; }
   hart_t* next() { return _next; }
   int tid() { return _tid; }
-  static hart_t* find(int tid); // hart given Linux thread ID
+  int number() { return sid; }	// also the cpu number seen by guest
+  static hart_t* find(int tid); // hart given Linux thread ID, O(1)
   static int num_harts() { return _num_harts; }
+  
+  void retire();		// thread exited, unlink and keep for reuse
+  static hart_t* reuse(hart_t* from); // pooled hart made a copy of from, or 0
+  // exited harts are not reused while another thread may be walking list()
+  static void begin_walk() { __sync_fetch_and_add(&_walkers, 1); }
+  static void end_walk() { __sync_fetch_and_sub(&_walkers, 1); }
 
   reg_t get_csr(int which, insn_t insn, bool write, bool peek =0);
   reg_t get_csr(int which) { return get_csr(which, insn_t(0), false, true); }
@@ -189,21 +243,27 @@ public:
   template<class T> bool cas(long r1, T replace, T expect, uintptr_t*& ap)
   {
     T* ptr = (T*)r1;
+    if (sequenced) sequence_begin(this);
     T oldval = __sync_val_compare_and_swap(ptr, expect, replace);
+    if (sequenced) sequence_end(this);
     *ap++ = (uintptr_t)ptr;
     return (oldval != expect);
   }
   template<typename op>	int32_t amo_int32(uintptr_t a, op f, uintptr_t*& ap) {
     int32_t lhs, *ptr = (int32_t*)a;
+    if (sequenced) sequence_begin(this);
     do lhs = *ptr;
     while (!__sync_bool_compare_and_swap(ptr, lhs, f(lhs)));
+    if (sequenced) sequence_end(this);
     *ap++ = (uintptr_t)ptr;
     return lhs;
   }
   template<typename op>	int64_t amo_int64(uintptr_t a, op f, uintptr_t*& ap) {
     int64_t lhs, *ptr = (int64_t*)a;
+    if (sequenced) sequence_begin(this);
     do lhs = *ptr;
     while (!__sync_bool_compare_and_swap(ptr, lhs, f(lhs)));
+    if (sequenced) sequence_end(this);
     *ap++ = (uintptr_t)ptr;
     return lhs;
   }
@@ -211,4 +271,10 @@ public:
 
 
 long default_riscv_syscall(hart_t* h, long a0);
+void write_checkpoint(const char* filename, hart_t* h);
+void restore_checkpoint(const char* filename, hart_t* h);
+bool checkpoint_event(hart_t* h);
 long proxy_syscall(long rvnum, long a0, long a1, long a2, long a3, long a4, long a5, hart_t* me);
+long guest_monotonic_ns(hart_t* h);
+void syscall_status();		// --sysprof summary for status line
+void syscall_report();		// --sysprof table at exit
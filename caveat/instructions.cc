@@ -7,38 +7,26 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 
-#include <string>
-#include <map>
-
 #include "caveat.h"
 #include "hart.h"
-
-std::map<long, std::string> fname; // dictionary of pc->name
+#include "symbols.h"
 
 const char* func_name(uintptr_t pc)
 {
-  return fname.count(pc)==1 ? const_cast<const char*>(fname.at(pc).c_str()) : "NOT FOUND";
+  long offset;
+  const char* name = find_symbol(pc, &offset);
+  return name && offset==0 ? name : "NOT FOUND";
 }
 
 #define LABEL_WIDTH  16
 #define OFFSET_WIDTH  8
 int slabelpc(char* buf, uintptr_t pc)
 {
-  auto it = fname.upper_bound(pc);
-  if (it == fname.end()) {
-    return sprintf(buf, "%*.*s+%*ld %8lx: ", LABEL_WIDTH, LABEL_WIDTH, "NONE", -(OFFSET_WIDTH-1), 0L, pc);
-  }
-  else {
-    it--;
-    if (it == fname.end()) {
-      return sprintf(buf, "%*.*s+%*ld %8lx: ", LABEL_WIDTH, LABEL_WIDTH, "UNKNOWN", -(OFFSET_WIDTH-1), 0L, pc);
-    }
-    else {
-      long offset = pc - it->first;
-      const char* name = const_cast<const char*>(it->second.c_str());
-      return sprintf(buf, "%*.*s+%*ld %8lx: ", LABEL_WIDTH, LABEL_WIDTH, name, -(OFFSET_WIDTH-1), offset, pc);
-    }
-  }
+  long offset = 0;
+  const char* name = find_symbol(pc, &offset);
+  if (!name)
+    name = "NONE";
+  return sprintf(buf, "%*.*s+%*ld %8lx: ", LABEL_WIDTH, LABEL_WIDTH, name, -(OFFSET_WIDTH-1), offset, pc);
 }
 
 void labelpc(uintptr_t pc, FILE* f)
@@ -14,6 +14,8 @@
 
 #include "caveat.h"
 #include "hart.h"
+#include "scheduler.h"
+#include "calls.h"
 
 #ifndef SPIKE
 #include "arithmetic.h"
@@ -87,13 +89,14 @@ void hart_t::default_interpreter()
   for (;;) {			// once per basic block
     Header_t* bb = ((*target)->addr == pc) ? *target : find_bb(pc);
     *target = bb;
+    tcache.enter(bb);
     uintptr_t addresses[1000];
     uintptr_t* ap = addresses;
     //
     // execute basic block
     //
     for (const Insn_t* i=insnp(bb+1); i<insnp(bb+1)+bb->count; i++) {
-      _executed++;
+      stats.executed++;
       //WRITE_REG(0, 0);
       debug.insert(pc, *i);
 #if 0
@@ -182,6 +185,12 @@ void hart_t::default_interpreter()
     WRITE_REG(0, 0);
     if (simulator)
       simulator(this, bb, addresses);
+    if (shadow)
+      shadow_block(this, bb);
+    if (stats.executed >= event_at && event(this))
+      return;
+    if (stats.executed >= yield_at)
+      sched_yield_hart(this);
   }
 }
 
@@ -260,6 +269,7 @@ bool hart_t::single_step()
 
   bb->addr = pc;
   bb->count = 1;
+  bb->number = 0;		// not in tcache
   Insn_t* i = (Insn_t*)bb + 2;	// skip over header
   uintptr_t oldpc = pc;
   *i = decoder(pc);
@@ -274,7 +284,7 @@ bool hart_t::single_step()
   disasm(pc, i);
 #endif 
 
-  _executed++;
+  stats.executed++;
   switch (i->opcode()) {
   case Op_ZERO:	die("Should never see Op_ZERO at pc=%lx", pc);
 #include "semantics.h"
@@ -292,5 +302,7 @@ bool hart_t::single_step()
   }
   if (simulator)
     simulator(this, bb, addresses);
+  if (stats.executed >= event_at)
+    return event(this);
   return false;
 }
@@ -0,0 +1,94 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "caveat.h"
+#include "region.h"
+#include "live.h"
+
+option<> conf_live("live",	0, "caveat",	"Per-instruction counters in /dev/shm segment for erised");
+
+live_t* live_counters;
+uintptr_t live_base, live_end;
+
+static const char* segment_name(const char* name, char* buf, size_t n)
+{
+  snprintf(buf, n, "/%s", name);
+  return buf;
+}
+
+/*
+  Counters cover the lowest run of text regions, the statically linked
+  guest program.  A new segment replaces any old one of the same name,
+  erised still reading the old one keeps its mapping.
+*/
+void live_open(const char* path)
+{
+  uintptr_t base=0, end=0;
+  for (auto& r : region_list()) {
+    if (r.kind != Region_text)
+      continue;
+    if (end && r.begin != end)
+      break;
+    if (!end)
+      base = r.begin;
+    end = r.end;
+  }
+  quitif(!end, "--live needs a loaded guest program");
+  char name[256];
+  segment_name(conf_live(), name, sizeof name);
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+  dieif(fd<0, "cannot create counters segment %s", name);
+  size_t size = LIVE_HEADER + (end-base) + (end-base)/2*sizeof(live_t);
+  dieif(ftruncate(fd, size), "cannot size counters segment %s", name);
+  live_header_t* h = (live_header_t*)mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  dieif(h==MAP_FAILED, "cannot map counters segment %s", name);
+  close(fd);
+  h->base = base;
+  h->end = end;
+  h->pid = getpid();
+  snprintf(h->path, sizeof h->path, "%s", path ? path : "");
+  memcpy((char*)h+LIVE_HEADER, (void*)base, end-base);
+  live_counters = live_array(h);
+  live_base = base;
+  live_end = end;
+  __atomic_store_n(&h->magic, LIVE_MAGIC, __ATOMIC_RELEASE);
+}
+
+live_header_t* live_attach(const char* name)
+{
+  char buf[256];
+  segment_name(name, buf, sizeof buf);
+  int fd = shm_open(buf, O_RDONLY, 0);
+  quitif(fd<0, "Cannot open counters segment /dev/shm%s", buf);
+  struct stat st;
+  live_header_t* h = 0;
+  for (int k=0; ; k++) {	// creator may not be finished
+    quitif(k==1000, "Counters segment /dev/shm%s never initialized", buf);
+    dieif(fstat(fd, &st), "cannot stat counters segment %s", buf);
+    if (st.st_size >= LIVE_HEADER) {
+      if (!h)
+	h = (live_header_t*)mmap(0, LIVE_HEADER, PROT_READ, MAP_SHARED, fd, 0);
+      dieif(h==MAP_FAILED, "cannot map counters segment %s", buf);
+      if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == LIVE_MAGIC)
+	break;
+    }
+    usleep(10000);
+  }
+  uintptr_t base=h->base, end=h->end;
+  munmap(h, LIVE_HEADER);
+  size_t size = LIVE_HEADER + (end-base) + (end-base)/2*sizeof(live_t);
+  quitif(st.st_size < size, "Counters segment /dev/shm%s is truncated", buf);
+  h = (live_header_t*)mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  dieif(h==MAP_FAILED, "cannot map counters segment %s", buf);
+  // decoder() and sdisasm() read instructions at their guest address
+  void* t = mmap((void*)base, end-base, PROT_READ, MAP_SHARED|MAP_FIXED_NOREPLACE, fd, LIVE_HEADER);
+  quitif(t!=(void*)base, "Cannot map guest text at %lx-%lx", base, end);
+  close(fd);
+  return h;
+}
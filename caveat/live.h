@@ -0,0 +1,50 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Per-instruction counters in a POSIX shared memory segment, read by
+  erised while the simulation runs.  The segment is a one page header,
+  a copy of the guest text so the reader can disassemble it, then one
+  live_t per 16-bit parcel of text.  Simulators add to the counters
+  with plain increments.  Two harts updating the same pc at the same
+  moment may lose a count, which a viewer does not notice.
+*/
+
+#ifndef LIVE_T
+#define LIVE_T
+
+#define LIVE_MAGIC   0x6576696c61766163L // "cavalive"
+#define LIVE_HEADER  4096
+
+struct live_t {
+  long count;			// executions
+  long cycles;			// including miss penalties
+  long imiss, dmiss;		// instruction and data cache misses
+};
+
+struct live_header_t {
+  volatile uint64_t magic;	// set last by creator
+  uintptr_t base, end;		// text, page aligned
+  long pid;			// of simulator
+  char path[LIVE_HEADER-4*8];	// guest program, for symbols
+};
+
+extern option<> conf_live;
+extern live_t* live_counters;	// [(pc-live_base)/2]
+extern uintptr_t live_base, live_end;
+
+void live_open(const char* path); // after guest program is loaded
+
+// counters of basic block at pc of length bytes, 0 if not in segment
+static inline live_t* live_at(uintptr_t pc, unsigned length)
+{
+  if (pc < live_base || pc+length > live_end)
+    return 0;
+  return live_counters + (pc-live_base)/2;
+}
+
+live_header_t* live_attach(const char* name); // reader, maps text copy at base
+static inline live_t* live_array(live_header_t* h) { return (live_t*)((char*)h + LIVE_HEADER + (h->end-h->base)); }
+
+#endif
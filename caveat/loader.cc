@@ -15,8 +15,13 @@
 #include <fcntl.h>
 #include <elf.h>
 
-#include <string>
-#include <map>
+#include "options.h"
+#include "region.h"
+#include "symbols.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
 
 #define RISCV_PGSHIFT 12
 #define RISCV_PGSIZE (1 << RISCV_PGSHIFT)
@@ -37,12 +42,10 @@ struct pinfo_t {
 struct pinfo_t current;
 struct pinfo_t interp;
 uintptr_t phdrs = 0xdeadbeef;
+uintptr_t tls_size;		// static TLS block of program
 
 long emulate_brk(long addr);
   
-extern std::map<long, std::string> fname; // dictionary of pc->name
-std::map<std::string, long> symaddr;
-
 /*
   Utility stuff.
 */
@@ -51,15 +54,48 @@ std::map<std::string, long> symaddr;
 //#define dbmsg(fmt, ...)		       { fprintf(stderr, fmt, ##__VA_ARGS__); fprintf(stderr, "\n"); }
 #define dbmsg(fmt, ...)
 
-#define MEM_END		0x60000000L
-#define STACK_SIZE	0x08000000L
-#define BRK_SIZE	0x01000000L
+/*
+  Guest address space layout.  By default the stack ends at 0x60000000
+  with the dynamic loader above it, below the simulator at 0x70000000,
+  and brk may grow 16MB past the program.  Heaps of many gigabytes need
+  the stack and loader moved up out of the way, for example
+  --guest-top=0x4000000000 --guest-interp=0x4000000000 --guest-brk=64g
+  The whole brk range is reserved at load time, so other mappings
+  cannot land in it.
+*/
+option<>     conf_guest_top   ("guest-top",	"0x60000000",	"Guest stack top address");
+option<>     conf_guest_stack ("guest-stack",	"128m",		"Guest stack size");
+option<>     conf_guest_brk   ("guest-brk",	"16m",		"Guest brk heap size limit");
+option<>     conf_guest_interp("guest-interp",	"0x60000000",	"Dynamic loader load address");
+option<>     conf_guest_mmap  ("guest-mmap",	0,		"Place guest mmaps upward from this address, default host chooses");
+option<bool> conf_guest_thp   ("guest-thp",	false, true,	"Back guest heap, stack and large mmaps with transparent huge pages");
+
+// hex, octal or decimal with optional k, m or g suffix
+static uintptr_t layout(const char* name, const char* value)
+{
+  char* end;
+  uintptr_t v = strtoul(value, &end, 0);
+  switch (*end) {
+  case 'g': case 'G':  v <<= 10;
+  case 'm': case 'M':  v <<= 10;
+  case 'k': case 'K':  v <<= 10;  end++;
+  }
+  quitif(end==value || *end, "--%s=%s is not a number", name, value);
+  return v;
+}
+
+#define MEM_END		layout("guest-top",    conf_guest_top())
+#define STACK_SIZE	layout("guest-stack",  conf_guest_stack())
+#define BRK_SIZE	layout("guest-brk",    conf_guest_brk())
+#define INTERP_BASE	layout("guest-interp", conf_guest_interp())
 
-#define INTERP_BASE	MEM_END
+#define HUGE_PAGE	(2L<<20)
 
-static char* strtbl;
-static Elf64_Sym* symtbl;
-static long num_syms;
+static void huge(uintptr_t begin, uintptr_t end)
+{
+  if (conf_guest_thp() && end-begin >= HUGE_PAGE)
+    madvise((void*)begin, end-begin, MADV_HUGEPAGE);
+}
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -78,10 +114,17 @@ long emulate_brk(long addr)
     info->brk = ROUNDUP(info->brk_min, RISCV_PGSIZE);
 
   long newbrk_page = ROUNDUP(newbrk, RISCV_PGSIZE);
-  if (info->brk > newbrk_page)
-    munmap((void*)newbrk_page, info->brk - newbrk_page);
-  else if (info->brk < newbrk_page)
-    assert(mmap((void*)info->brk, newbrk_page - info->brk, -1, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, 0, 0) == (void*)info->brk);
+  if (info->brk > newbrk_page) {	// discard pages, range stays reserved
+    dieif(mmap((void*)newbrk_page, info->brk - newbrk_page, PROT_NONE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0) != (void*)newbrk_page,
+	  "brk shrink to %lx failed", newbrk_page);
+    huge(newbrk_page, info->brk);
+    region_remove(newbrk_page, info->brk);
+  }
+  else if (info->brk < newbrk_page) {
+    dieif(mprotect((void*)info->brk, newbrk_page - info->brk, PROT_READ|PROT_WRITE),
+	  "brk grow to %lx failed", newbrk_page);
+    region_add(info->brk, newbrk_page, PROT_READ|PROT_WRITE, true, Region_heap);
+  }
   info->brk = newbrk_page;
 
   return newbrk;
@@ -103,87 +146,70 @@ static inline int get_prot(uint32_t p_flags)
 static void read_elf_symbols(const char* filename, uintptr_t bias)
 {
   dbmsg("reading %s symbols, bias=0x%lx", filename, bias);
-  int fd = open(filename, O_RDONLY, 0);
-  quitif(fd<0, "Unable to open ELF binary file \"%s\"\n", filename);
-  Elf64_Ehdr eh;
-  dieif(read(fd, &eh, sizeof(eh))!=sizeof(eh), "read elf header failed");
-  quitif(!(eh.e_ident[0] == '\177' && eh.e_ident[1] == 'E' &&
-	   eh.e_ident[2] == 'L'    && eh.e_ident[3] == 'F'),
-	 "Elf header not correct");
-  
-  /* Read section header string table. */
-  dieif(lseek(fd, eh.e_shoff + eh.e_shstrndx * sizeof(Elf64_Shdr), SEEK_SET)<0, "seek string section header failed");
-  Elf64_Shdr shdr;
-  dieif(read(fd, &shdr, sizeof shdr)<0, "read string section header failed");
-  char* shstrtbl = new char[shdr.sh_size];
-  dieif(lseek(fd, shdr.sh_offset, SEEK_SET)<0, "lseek shstrtbl failed");
-  dieif(read(fd, shstrtbl, shdr.sh_size)!=shdr.sh_size, "read shstrtbl failed");
-
-  // First find string table and copy into memory
-  char* strtbl = 0;
-  for (int i=eh.e_shnum-1; i>=0; i--) {
-    dieif(lseek(fd, eh.e_shoff + i * sizeof(Elf64_Shdr), SEEK_SET)<0, "seek section header failed");
-    dieif(read(fd, &shdr, sizeof shdr)<0, "read section header failed");
-    if (strcmp(shstrtbl+shdr.sh_name, ".strtab") == 0) {
-      dbmsg("%s size %ld\n", shstrtbl+shdr.sh_name, shdr.sh_size);
-      
-    	//    if (strcmp(shstrtbl+shdr.sh_name, ".strtab") == 0 ||
-	//	strcmp(shstrtbl+shdr.sh_name, ".dynstr") == 0) {
-      strtbl = new char[shdr.sh_size];
-      dieif(lseek(fd, shdr.sh_offset, SEEK_SET)<0, "lseek strtbl failed");
-      dieif(read(fd, strtbl, shdr.sh_size)!=shdr.sh_size, "read strtbl failed");
-      break;
-    }
+  load_symbols(filename, bias);
+}
+
+static uintptr_t at_base = 0;
+static uintptr_t hack_bias;
+static volatile uintptr_t mmap_next;	// --guest-mmap
+
+/*
+  PT_LOAD segments are mapped copy-on-write from the file, so pages the
+  guest never writes stay shared with the page cache and with other
+  simulations of the same binary.  The part of .bss past the last file
+  page comes from anonymous zero pages.  Needs every segment congruent
+  to its file offset modulo the page size and no page shared by two
+  segments, otherwise the segments are read into anonymous memory.
+*/
+static bool mappable(Elf64_Phdr* ph, int phnum, uintptr_t bias)
+{
+  uintptr_t prev_end = 0;
+  for (int i=0; i<phnum; i++) {
+    if (ph[i].p_type != PT_LOAD)
+      continue;
+    if ((ph[i].p_vaddr - ph[i].p_offset) % RISCV_PGSIZE != 0)
+      return false;
+    uintptr_t begin = ROUNDDOWN(ph[i].p_vaddr+bias, RISCV_PGSIZE);
+    if (begin < prev_end)
+      return false;
+    prev_end = ROUNDUP(ph[i].p_vaddr+bias+ph[i].p_memsz, RISCV_PGSIZE);
   }
-  // Next read symbol tables
-  for (int i=eh.e_shnum-1; i>=0; i--) {
-    dieif(lseek(fd, eh.e_shoff + i * sizeof(Elf64_Shdr), SEEK_SET)<0, "seek section header failed");
-    dieif(read(fd, &shdr, sizeof shdr)<0, "read section header failed");
-    
-    //    if (strcmp(shstrtbl+shdr.sh_name, ".symtab") == 0  ||
-    //	strcmp(shstrtbl+shdr.sh_name, ".dynsym") == 0) {
-    
-    if (strcmp(shstrtbl+shdr.sh_name, ".symtab") == 0) {
-      long num_syms = shdr.sh_size / sizeof(Elf64_Sym);
-      dbmsg("%s num_syms=%ld", shstrtbl+shdr.sh_name, num_syms);
-      //      Elf64_Sym symtbl[num_syms];
-      dieif(lseek(fd, shdr.sh_offset, SEEK_SET)<0, "lseek symtbl failed");
-      Elf64_Sym sb;
-      for (int k=0; k<shdr.sh_size/sizeof(Elf64_Sym); k++) {
-	dieif(read(fd, &sb, sizeof(Elf64_Sym))!=sizeof(Elf64_Sym), "read symtbl failed");
-	//dbmsg("%16lx %s", sb.st_value+bias, strtbl+sb.st_name);
-	
-	//	if (ELF64_ST_TYPE(sb.st_info) == STT_FUNC)
-	  fname[sb.st_value + bias] = strtbl + sb.st_name;
-	if (ELF64_ST_TYPE(sb.st_info) == STT_OBJECT)
-	  symaddr[strtbl + sb.st_name] = sb.st_value + bias;
-	  //	  objsym][strtbl + sb.st_name = { .addr=sb.st_value+bias, .size=sb.st_size };
+  return true;
+}
 
+static void map_segments(int file, Elf64_Phdr* ph, int phnum, uintptr_t bias)
+{
+  for (int i=0; i<phnum; i++) {
+    if (ph[i].p_type != PT_LOAD)
+      continue;
+    int prot = get_prot(ph[i].p_flags);
+    region_kind_t kind = (ph[i].p_flags & PF_X) ? Region_text : Region_data;
+    uintptr_t vaddr = ph[i].p_vaddr + bias;
+    uintptr_t begin = ROUNDDOWN(vaddr, RISCV_PGSIZE);
+    uintptr_t filend = vaddr + ph[i].p_filesz;
+    uintptr_t mapend = ph[i].p_filesz ? ROUNDUP(filend, RISCV_PGSIZE) : begin;
+    uintptr_t end = ROUNDUP(vaddr + ph[i].p_memsz, RISCV_PGSIZE);
+    if (mapend > begin) {
+      // last file page is shared with .bss, clear the rest of it
+      bool partial = ph[i].p_memsz > ph[i].p_filesz && filend < mapend;
+      void* m = mmap((void*)begin, mapend-begin, partial ? prot|PROT_WRITE : prot,
+		     MAP_FIXED|MAP_PRIVATE, file, ROUNDDOWN(ph[i].p_offset, RISCV_PGSIZE));
+      dieif(m!=(void*)begin, "mmap() segment failed");
+      if (partial) {
+	memset((void*)filend, 0, mapend-filend);
+	if (!(prot & PROT_WRITE))
+	  mprotect((void*)begin, mapend-begin, prot);
       }
-      break;
+      region_add(begin, mapend, prot, false, kind);
+    }
+    if (end > mapend) {
+      void* m = mmap((void*)mapend, end-mapend, prot, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      dieif(m!=(void*)mapend, "mmap() bss failed");
+      region_add(mapend, end, prot, true, kind);
     }
   }
-
-#if 0
-  // hack to inhibit ld.so.cache
-  if (symaddr.count("_rtld_global_ro")) {
-    dbmsg("_rtld_global_ro 0x%lx setting to 1", symaddr["_rtld_global_ro"]);
-    int* p = (int*)(symaddr["_rtld_global_ro"] + 32);
-    *p = 1;
-  }
-  else
-    dbmsg("_rtld_global_ro not found");
-#endif	  
-  //  for (auto it=fname.begin(); it!=fname.end(); it++)
-  //    fprintf(stderr, "%16lx  %s\n", it->first, const_cast<const char*>(it->second.c_str()));
-  
-  //  delete strtbl;
-  close(fd);
 }
 
-static uintptr_t at_base = 0;
-static uintptr_t hack_bias;
-
 static long load_elf_file(const char* file_name, uintptr_t bias, pinfo_t* info)
 {
   dbmsg("Loading %s, bias=%lx", file_name, bias);
@@ -191,9 +217,6 @@ static long load_elf_file(const char* file_name, uintptr_t bias, pinfo_t* info)
   ssize_t ehdr_size;
   size_t phdr_size;
   long number_of_insn;
-  size_t tblsz;
-  char* shstrtbl;
-  ssize_t ret;
   
   int file = open(file_name, O_RDONLY, 0);
   quitif(file<0, "Unable to open binary file \"%s\"\n", file_name);
@@ -256,58 +279,54 @@ static long load_elf_file(const char* file_name, uintptr_t bias, pinfo_t* info)
   // round down to page boundry to get mmap region
   uintptr_t prepad = first % RISCV_PGSIZE;
   void* base = (void*)(first - prepad);
-  size_t len = last - first + prepad;
-  dieif(mmap(base, len, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, 0, 0)!=base, "mmap() failed");
-  
-  // first read file header into prepad
-  dieif(lseek(file, 0, SEEK_SET) < 0, "lseek failed");
-  dieif(read(file, base, prepad)!=prepad, "read failed");
-  for (int i=0; i<eh.e_phnum; i++) {
-    if (ph[i].p_type != PT_LOAD)
-      continue;
-    dieif(lseek(file, ph[i].p_offset, SEEK_SET) < 0, "lseek failed");
-    dieif(read(file, (void*)(ph[i].p_vaddr+bias), ph[i].p_filesz)!=ph[i].p_filesz, "read failed");
-    // check for .bss and friends
-    size_t zeros = ph[i].p_memsz - ph[i].p_filesz;
-    if (zeros > 0) {
-      uintptr_t begin = ph[i].p_vaddr + bias + ph[i].p_filesz;
-      //memset((void*)begin, 0, zeros);
-      for (int k=0; k<zeros; k++)
-	((char*)begin)[k] = 0;
+  if (mappable(ph, eh.e_phnum, bias))
+    map_segments(file, ph, eh.e_phnum, bias);
+  else {			// copy into anonymous memory, already zero
+    size_t len = last - first + prepad;
+    dieif(mmap(base, len, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, 0, 0)!=base, "mmap() failed");
+    region_add((uintptr_t)base, ROUNDUP((uintptr_t)base+len, RISCV_PGSIZE), PROT_READ|PROT_WRITE, true, Region_data);
+    for (int i=0; i<eh.e_phnum; i++) {
+      if (ph[i].p_type == PT_LOAD && (ph[i].p_flags & PF_X))
+	region_add(ROUNDDOWN(ph[i].p_vaddr+bias, RISCV_PGSIZE), ROUNDUP(ph[i].p_vaddr+bias+ph[i].p_memsz, RISCV_PGSIZE),
+		   PROT_READ|PROT_WRITE, true, Region_text);
+    }
+    // first read file header into prepad
+    dieif(lseek(file, 0, SEEK_SET) < 0, "lseek failed");
+    dieif(read(file, base, prepad)!=prepad, "read failed");
+    for (int i=0; i<eh.e_phnum; i++) {
+      if (ph[i].p_type != PT_LOAD)
+	continue;
+      dieif(lseek(file, ph[i].p_offset, SEEK_SET) < 0, "lseek failed");
+      dieif(read(file, (void*)(ph[i].p_vaddr+bias), ph[i].p_filesz)!=ph[i].p_filesz, "read failed");
     }
   }
   
   // record program header address for aux vector
   phdrs = (uintptr_t)base + eh.e_phoff;
-  /* Read section header string table. */
-  Elf64_Shdr header;
-  assert(lseek(file, eh.e_shoff + eh.e_shstrndx * sizeof(Elf64_Shdr), SEEK_SET) >= 0);
-  assert(read(file, &header, sizeof header) >= 0);
-
-  dieif(lseek(file, header.sh_offset, SEEK_SET) < 0, "lseek failed");
-  shstrtbl = new char[header.sh_size];
-  dieif(read(file, shstrtbl, header.sh_size) != (ssize_t)header.sh_size, "read shstrtbl failed");
-
-  //for (int i=eh.e_shnum-1; i>=0; i--) {
-  for (int i=eh.e_shnum-1; i>0; i--) {
-    assert(lseek(file, eh.e_shoff + i * sizeof(Elf64_Shdr), SEEK_SET) >= 0);
-    //assert(read(file, &header, sizeof header) >= 0);
-    assert(read(file, &header, sizeof header) == sizeof header);
-    if (strcmp(shstrtbl+header.sh_name, ".bss") == 0 ||
-	//	strcmp(shstrtbl+header.sh_name, ".tbss") == 0 ||
-	strcmp(shstrtbl+header.sh_name, ".sbss") == 0) {
-      memset((void*)(header.sh_addr+bias), 0, header.sh_size);
-    }
-  }
+  for (int i=0; i<eh.e_phnum; i++)
+    if (ph[i].p_type == PT_TLS && info == &current)
+      tls_size = ph[i].p_memsz;
 
   close(file);
-  delete shstrtbl;
   return entry;
 }
 
+// PROT_NONE pages from current break to limit, made accessible by emulate_brk()
+static void reserve_brk(pinfo_t* info)
+{
+  uintptr_t begin = info->brk ? info->brk : ROUNDUP(info->brk_min, RISCV_PGSIZE);
+  uintptr_t end = ROUNDUP(info->brk_max, RISCV_PGSIZE);
+  if (begin >= end)
+    return;
+  void* m = mmap((void*)begin, end-begin, PROT_NONE, MAP_FIXED_NOREPLACE|MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  quitif(m!=(void*)begin, "Cannot reserve brk heap %lx-%lx, overlaps other memory, change --guest-brk or --guest-top", begin, end);
+  huge(begin, end);
+}
+
 static long load_elf_binary(const char* file_name)
 {
   long entry = load_elf_file(file_name, 0, &current);
+  reserve_brk(&current);
   read_elf_symbols(file_name, hack_bias);
   //read_elf_symbols(file_name, 0);
   return entry;
@@ -322,9 +341,12 @@ struct aux_t {
 static long initialize_stack(int argc, const char** argv, const char** envp, pinfo_t* info)
 {
   // allocate stack space
-  void* stack_lowest = mmap((void*)(MEM_END-STACK_SIZE), STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-  dieif(stack_lowest != (void*)(MEM_END-STACK_SIZE), "Could not allocate stack\n");
   uintptr_t stack_top = MEM_END;
+  uintptr_t stack_lowest = stack_top - STACK_SIZE;
+  void* m = mmap((void*)stack_lowest, stack_top-stack_lowest, PROT_READ|PROT_WRITE, MAP_FIXED_NOREPLACE|MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  quitif(m != (void*)stack_lowest, "Cannot allocate stack %lx-%lx, overlaps other memory, change --guest-top or --guest-stack", stack_lowest, stack_top);
+  huge(stack_lowest, stack_top);
+  region_add(stack_lowest, stack_top, PROT_READ|PROT_WRITE, true, Region_stack);
 
   // first comes copy of program header
   int fd = open(argv[0], O_RDONLY, 0);
@@ -433,38 +455,99 @@ long emulate_execve(const char* filename, int argc, const char* argv[], const ch
 {
   pc = load_elf_binary(argv[0]);
   dbmsg("interp.base=%lx", at_base);
+  if (conf_guest_mmap())
+    mmap_next = layout("guest-mmap", conf_guest_mmap());
   return initialize_stack(argc, argv, envp, &current);
 }
 
 
+/*
+  Loader state needed to resume a checkpointed process.
+*/
+
+static void save_path(FILE* f, const char* path)
+{
+  size_t n = path ? strlen(path)+1 : 0;
+  fwrite(&n, sizeof n, 1, f);
+  fwrite(path, 1, n, f);
+}
+
+static char* restore_path(FILE* f)
+{
+  size_t n;
+  dieif(fread(&n, sizeof n, 1, f)!=1, "read checkpoint path failed");
+  if (n == 0)
+    return 0;
+  char* path = new char[n];
+  dieif(fread(path, 1, n, f)!=n, "read checkpoint path failed");
+  return path;
+}
+
+void save_loader_state(FILE* f)
+{
+  fwrite(&current, sizeof current, 1, f);
+  fwrite(&interp, sizeof interp, 1, f);
+  fwrite(&phdrs, sizeof phdrs, 1, f);
+  fwrite(&at_base, sizeof at_base, 1, f);
+  fwrite(&hack_bias, sizeof hack_bias, 1, f);
+  save_path(f, current.path);
+  save_path(f, interp.path);
+}
+
+void restore_loader_state(FILE* f)
+{
+  dieif(fread(&current, sizeof current, 1, f)!=1, "read checkpoint loader state failed");
+  dieif(fread(&interp, sizeof interp, 1, f)!=1, "read checkpoint loader state failed");
+  dieif(fread(&phdrs, sizeof phdrs, 1, f)!=1, "read checkpoint loader state failed");
+  dieif(fread(&at_base, sizeof at_base, 1, f)!=1, "read checkpoint loader state failed");
+  dieif(fread(&hack_bias, sizeof hack_bias, 1, f)!=1, "read checkpoint loader state failed");
+  current.path = restore_path(f);
+  interp.path = restore_path(f);
+  // symbols are only for display, so a missing binary is not fatal
+  if (interp.path && access(interp.path, R_OK)==0)
+    read_elf_symbols(interp.path, INTERP_BASE);
+  if (current.path && access(current.path, R_OK)==0)
+    read_elf_symbols(current.path, hack_bias);
+  reserve_brk(&current);
+  if (conf_guest_mmap())
+    mmap_next = layout("guest-mmap", conf_guest_mmap());
+}
+
+/*
+  Guest mmap system calls.  Without MAP_FIXED the kernel treats the
+  address as a hint and goes elsewhere if it is taken.
+*/
+uintptr_t mmap_hint(uintptr_t addr, int flags)
+{
+  if (addr || (flags & MAP_FIXED) || !conf_guest_mmap())
+    return addr;
+  return mmap_next;
+}
+
+void mmap_done(uintptr_t addr, size_t len, int flags)
+{
+  uintptr_t end = ROUNDUP(addr+len, RISCV_PGSIZE);
+  uintptr_t next = mmap_next;
+  while (conf_guest_mmap() && next <= addr && !__sync_bool_compare_and_swap(&mmap_next, next, end))
+    next = mmap_next;
+  if ((flags & MAP_ANONYMOUS) && (flags & MAP_PRIVATE))
+    huge(addr, end);
+}
+
+
 int elf_find_symbol(const char* name, long* begin, long* end)
 {
-  if (strtbl) {
-    for (int i=0; i<num_syms; i++) {
-      int n = strlen(name);
-      if (strncmp(strtbl+symtbl[i].st_name, name, n) == 0) {
-	*begin = symtbl[i].st_value;
-	if (end)
-	  *end = *begin + symtbl[i].st_size;
-	return 1;
-      }
-    }
-  }
-  return 0;
+  return symbol_address(name, (uintptr_t*)begin, (uintptr_t*)end);
 }
 
 
 const char* elf_find_pc(long pc, long* offset)
 {
-  if (symtbl) {
-    for (int i=0; i<num_syms; i++) {
-      if (symtbl[i].st_value <= pc && pc < symtbl[i].st_value+symtbl[i].st_size) {
-	*offset = pc - symtbl[i].st_value;
-	return strtbl + symtbl[i].st_name;
-      }
-    }
-  }
-  return 0;
+  uintptr_t begin, end;
+  const char* name = find_symbol(pc, offset);
+  if (!name || !symbol_address(name, &begin, &end) || pc >= end)
+    return 0;
+  return name;
 }
 
 
@@ -0,0 +1,107 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "caveat.h"
+#include "hart.h"
+#include "region.h"
+#include "symbols.h"
+#include "profile.h"
+
+option<int> conf_profile("profile",	0, 10,		"Report this many hottest functions with annotated disassembly");
+
+struct block_profile_t {
+  long entries;
+  unsigned count;		// instructions in block
+};
+
+static map<uintptr_t, block_profile_t> blocks; // keyed by block address
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void profile_harvest(Tcache_t* tc)
+{
+  pthread_mutex_lock(&blocks_lock);
+  tc->harvest([](Header_t* bb, long n) {
+    block_profile_t& b = blocks[bb->addr];
+    b.entries += n;
+    b.count = bb->count;
+  });
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+struct function_t {
+  const char* name;
+  long insns;
+  vector<uintptr_t> pcs;	// executed, sorted later
+};
+
+static void annotate(FILE* f, function_t& fn, map<uintptr_t, long>& at, long total)
+{
+  fprintf(f, "\n%s  %ld instructions %5.2f%%\n", fn.name, fn.insns, 100.0*fn.insns/total);
+  sort(fn.pcs.begin(), fn.pcs.end());
+  fn.pcs.erase(unique(fn.pcs.begin(), fn.pcs.end()), fn.pcs.end());
+  char buf[1024];
+  uintptr_t expect = 0;
+  for (uintptr_t pc : fn.pcs) {
+    if (expect && pc != expect)
+      fprintf(f, "%7s %14s  ...\n", "", "");
+    Insn_t i = decoder(pc);
+    int n = slabelpc(buf, pc);
+    sdisasm(buf+n, pc, &i);
+    fprintf(f, "%6.2f%% %14ld  %s\n", 100.0*at[pc]/fn.insns, at[pc], buf);
+    expect = pc + (i.compressed() ? 2 : 4);
+  }
+}
+
+void profile_report(FILE* f, int functions)
+{
+  hart_t::begin_walk();
+  for (hart_t* p=hart_t::list(); p; p=p->next())
+    profile_harvest(&p->tcache);
+  hart_t::end_walk();
+  pthread_mutex_lock(&blocks_lock);
+  vector< pair<uintptr_t, block_profile_t> > v(blocks.begin(), blocks.end());
+  pthread_mutex_unlock(&blocks_lock);
+  sort(v.begin(), v.end(), [](auto& a, auto& b) { return a.second.entries*a.second.count > b.second.entries*b.second.count; });
+
+  // hottest blocks first into instructions per pc and per function
+  map<uintptr_t, long> at;
+  map<uintptr_t, function_t> fns; // keyed by function address
+  long total = 0;
+  for (auto& b : v) {
+    if (region_of(b.first) == Region_unknown)
+      continue;			// code was unmapped
+    long offset = 0;
+    const char* name = find_symbol(b.first, &offset);
+    function_t& fn = fns[b.first-offset];
+    fn.name = name ? name : "NONE";
+    fn.insns += b.second.entries * b.second.count;
+    total += b.second.entries * b.second.count;
+    uintptr_t pc = b.first;
+    for (unsigned k=0; k<b.second.count; k++) {
+      at[pc] += b.second.entries;
+      fn.pcs.push_back(pc);
+      Insn_t i = decoder(pc);
+      pc += i.compressed() ? 2 : 4;
+    }
+  }
+  if (total == 0)
+    return;
+
+  vector<function_t*> hot;
+  for (auto& e : fns)
+    hot.push_back(&e.second);
+  sort(hot.begin(), hot.end(), [](function_t* a, function_t* b) { return a->insns > b->insns; });
+  if (hot.size() > functions)
+    hot.resize(functions);
+  fprintf(f, "\nProfile of %ld instructions in %ld blocks, %ld functions\n", total, v.size(), fns.size());
+  fprintf(f, "%7s %14s  %s\n", "insns%", "instructions", "function");
+  for (function_t* fn : hot)
+    fprintf(f, "%6.2f%% %14ld  %s\n", 100.0*fn->insns/total, fn->insns, fn->name);
+  for (function_t* fn : hot)
+    annotate(f, *fn, at, total);
+}
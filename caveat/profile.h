@@ -0,0 +1,17 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Basic block execution profile.  The interpreter counts entries into
+  every block of each hart's Tcache_t.  profile_harvest() folds those
+  counters into one table keyed by block address, so counts outlive
+  exited harts and translation cache flushes.  At exit the report ranks
+  functions by instructions executed and prints the hottest ones as
+  disassembly annotated with the share of instructions at each pc.
+*/
+
+extern option<int> conf_profile;
+
+void profile_harvest(Tcache_t* tc); // before hart retires or tcache is flushed
+void profile_report(FILE* f, int functions);
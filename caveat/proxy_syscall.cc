@@ -21,18 +21,48 @@
 #include <string.h>
 #include <signal.h>
 #include <sched.h>
+#include <setjmp.h>
+#include <limits.h>
 
 #include <thread>
+#include <algorithm>
 
 #include "caveat.h"
 #include "hart.h"
+#include "region.h"
+#include "scheduler.h"
+#include "record.h"
+#include "affinity.h"
 
 #define THREAD_STACK_SIZE (1<<16)
 
 extern long emulate_brk(long addr);
+extern uintptr_t mmap_hint(uintptr_t addr, int flags);
+extern void mmap_done(uintptr_t addr, size_t len, int flags);
+extern uintptr_t tls_size;
 uintptr_t host_syscall(int sysnum, uintptr_t a0, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5);
 
 option<bool> conf_ecall("ecall",	false, true,			"Show system calls");
+option<long> conf_simclock("simclock",	0,				"Guest clocks run from simulated cycles at this MHz, 0=host time");
+option<bool> conf_sysprof("sysprof",	false, true,			"Profile system calls, report at exit");
+
+#define futex(a, b, c)  syscall(SYS_futex, a, b, c, 0, 0, 0)
+
+static thread_local jmp_buf thread_exit;	// longjmp here when guest thread exits
+
+// guest thread exit, hart is kept for reuse by a later clone
+static void exit_thread(hart_t* me)
+{
+  int* ctid = (int*)me->clear_child_tid;
+  me->retire();
+  if (ctid) {			// pthread_join() waits on this
+    *ctid = 0;
+    futex(ctid, FUTEX_WAKE, INT_MAX);
+  }
+  if (sched_active())
+    sched_exit(me);
+  longjmp(thread_exit, 1);
+}
 
 static timeval start_tv;
 
@@ -85,6 +115,265 @@ static struct syscall_map_t rv_to_host[] = {
 
 int maintid;
 
+/*
+  The guest has no vDSO, so time and identity queries arrive as ecalls.
+  Answer them here: host libc reads the clock through the host vDSO,
+  the pid never changes, and the cpu is the hart number.  RISC-V and
+  x86_64 struct timespec and timeval have the same layout.
+*/
+/*
+  With --simclock guest time advances with the timing model cycle count
+  instead of host time.  Clocks start at host time when the simulator
+  started, and sleeping adds to the hart's simulated time without
+  blocking the host.
+*/
+#define NS	1000000000L
+
+static long host_ns(clockid_t clk)
+{
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return ts.tv_sec*NS + ts.tv_nsec;
+}
+
+static long realtime_base = host_ns(CLOCK_REALTIME);
+static long monotonic_base = host_ns(CLOCK_MONOTONIC);
+
+static long simulated_ns(hart_t* h)
+{
+  return (h->cycle_count() + h->sleep_cycles) * 1000 / conf_simclock();
+}
+
+long guest_monotonic_ns(hart_t* h)
+{
+  if (!conf_simclock())
+    return host_ns(CLOCK_MONOTONIC);
+  return monotonic_base + simulated_ns(h);
+}
+
+static long guest_ns(clockid_t clk, hart_t* h)
+{
+  switch (clk) {
+  case CLOCK_REALTIME:
+  case CLOCK_REALTIME_COARSE:
+  case CLOCK_TAI:
+    return realtime_base + simulated_ns(h);
+  case CLOCK_PROCESS_CPUTIME_ID:
+  case CLOCK_THREAD_CPUTIME_ID:
+    return simulated_ns(h);
+  default:
+    return monotonic_base + simulated_ns(h);
+  }
+}
+
+static void advance_sleep(hart_t* h, long ns)
+{
+  if (ns > 0)
+    h->sleep_cycles += ns * conf_simclock() / 1000;
+}
+
+static bool simclock_syscall(long sysnum, long a0, long a1, long a2, long a3, hart_t* me, long& rv)
+{
+  struct timespec* ts;
+  switch (sysnum) {
+  case SYS_clock_gettime:
+    if (a0 < 0)			// dynamic clocks are host devices
+      return false;
+    {
+      long ns = guest_ns(a0, me);
+      ts = (struct timespec*)a1;
+      ts->tv_sec  = ns / NS;
+      ts->tv_nsec = ns % NS;
+    }
+    rv = 0;
+    return true;
+  case SYS_gettimeofday:
+    if (a0) {
+      long ns = guest_ns(CLOCK_REALTIME, me);
+      ((struct timeval*)a0)->tv_sec  = ns / NS;
+      ((struct timeval*)a0)->tv_usec = ns % NS / 1000;
+    }
+    if (a1)
+      memset((void*)a1, 0, sizeof(struct timezone));
+    rv = 0;
+    return true;
+  case SYS_nanosleep:
+    ts = (struct timespec*)a0;
+    advance_sleep(me, ts->tv_sec*NS + ts->tv_nsec);
+    if (a1)
+      memset((void*)a1, 0, sizeof(struct timespec));
+    rv = 0;
+    return true;
+  case SYS_clock_nanosleep:
+    ts = (struct timespec*)a2;
+    if (a1 & TIMER_ABSTIME)
+      advance_sleep(me, ts->tv_sec*NS + ts->tv_nsec - guest_ns(a0, me));
+    else {
+      advance_sleep(me, ts->tv_sec*NS + ts->tv_nsec);
+      if (a3)
+	memset((void*)a3, 0, sizeof(struct timespec));
+    }
+    rv = 0;
+    return true;
+  }
+  return false;
+}
+
+static bool fast_syscall(long sysnum, long a0, long a1, long a2, long a3, hart_t* me, long& rv)
+{
+  static int host_pid = getpid();
+  if (conf_simclock() && simclock_syscall(sysnum, a0, a1, a2, a3, me, rv))
+    return true;
+  switch (sysnum) {
+  case SYS_clock_gettime:
+    rv = clock_gettime(a0, (struct timespec*)a1) ? -errno : 0;
+    return true;
+  case SYS_gettimeofday:
+    rv = gettimeofday((struct timeval*)a0, (struct timezone*)a1) ? -errno : 0;
+    return true;
+  case SYS_getpid:
+    rv = host_pid;
+    return true;
+  case SYS_gettid:		// virtual when M:N scheduled
+    rv = me->tid();
+    return true;
+  case SYS_getcpu:
+    if (a0)
+      *(unsigned*)a0 = me->number();
+    if (a1)
+      *(unsigned*)a1 = 0;	// node
+    rv = 0;
+    return true;
+  }
+  return false;
+}
+
+/*
+  With --sysprof every proxied system call is counted by RISC-V ecall
+  number, with bytes moved by read/write-style calls and a log2
+  histogram of host latency.  Counters are shared by all harts and
+  updated without locking; per-hart totals live in hart_stats_t.
+*/
+#define LATENCY_BUCKETS	40	// log2 nanoseconds
+
+struct sysprof_t {
+  long calls;
+  long bytes;
+  long ns;			// host time
+  long latency[LATENCY_BUCKETS];
+};
+
+static sysprof_t sysprof[HIGHEST_ECALL_NUM+1];
+
+static void profile_syscall(hart_t* me, long rvnum, long sysnum, long rv, long ns)
+{
+  sysprof_t* p = &sysprof[rvnum];
+  __sync_fetch_and_add(&p->calls, 1);
+  __sync_fetch_and_add(&p->ns, ns);
+  int k = ns > 0 ? 63-__builtin_clzl(ns) : 0;
+  if (k >= LATENCY_BUCKETS)
+    k = LATENCY_BUCKETS-1;
+  __sync_fetch_and_add(&p->latency[k], 1);
+  if (rv > 0) {
+    switch (sysnum) {
+    case SYS_read:
+    case SYS_write:
+    case SYS_pread64:
+    case SYS_pwrite64:
+    case SYS_readv:
+    case SYS_writev:
+    case SYS_preadv:
+    case SYS_pwritev:
+    case SYS_recvfrom:
+    case SYS_sendto:
+    case SYS_recvmsg:
+    case SYS_sendmsg:
+    case SYS_sendfile:
+    case SYS_splice:
+    case SYS_copy_file_range:
+      __sync_fetch_and_add(&p->bytes, rv);
+    }
+  }
+  me->stats.syscalls++;
+  me->stats.syscall_ns += ns;
+}
+
+// appended to status line
+void syscall_status()
+{
+  long calls = 0, ns = 0;
+  for (int n=0; n<=HIGHEST_ECALL_NUM; n++) {
+    calls += sysprof[n].calls;
+    ns += sysprof[n].ns;
+  }
+  fprintf(stderr, " syscalls %ld(%3.1fs)", calls, ns/1e9);
+}
+
+void syscall_report()
+{
+  int order[HIGHEST_ECALL_NUM+1];
+  int n = 0;
+  for (int k=0; k<=HIGHEST_ECALL_NUM; k++)
+    if (sysprof[k].calls)
+      order[n++] = k;
+  std::sort(order, order+n, [](int a, int b) { return sysprof[a].ns > sysprof[b].ns; });
+  double realtime = elapse_time();
+  fprintf(stderr, "\n%-20s %10s %12s %10s %9s  latency log2(ns):count\n",
+	  "System call", "calls", "bytes", "host ms", "mean us");
+  for (int j=0; j<n; j++) {
+    sysprof_t* p = &sysprof[order[j]];
+    fprintf(stderr, "%-20s %10ld %12ld %10.1f %9.2f ", rv_to_host[order[j]].name,
+	    p->calls, p->bytes, p->ns/1e6, p->ns/1e3/p->calls);
+    for (int k=0; k<LATENCY_BUCKETS; k++)
+      if (p->latency[k])
+	fprintf(stderr, " %d:%ld", k, p->latency[k]);
+    fprintf(stderr, "\n");
+  }
+  hart_t::begin_walk();
+  for (hart_t* h=hart_t::list(); h; h=h->next())
+    fprintf(stderr, "Hart [%d] %ld syscalls %3.1fms (%3.1f%% of %3.1fs)\n", h->number(),
+	    h->stats.syscalls, h->stats.syscall_ns/1e6, 100*h->stats.syscall_ns/1e9/realtime, realtime);
+  hart_t::end_walk();
+}
+
+// static TLS block starts at tp (RISC-V TLS variant I)
+static void mark_tls(uintptr_t tp)
+{
+  if (tp)
+    region_relabel(tp & ~4095L, (tp + (tls_size ? tls_size : 1) + 4095) & ~4095L, Region_tls);
+}
+
+// everything except logging, also called by --record and --playback
+static long perform_syscall(hart_t* me, long sysnum, long* a)
+{
+  long rv;
+  if (fast_syscall(sysnum, a[0], a[1], a[2], a[3], me, rv))
+    ;
+  else if (sysnum == SYS_clone)
+    //    s.xrf[10] = hart_pointer->clone(hart_pointer, (long*)s.xrf+10);
+    rv = me->clone(me);
+  else if (sysnum == SYS_set_tid_address) {
+    me->clear_child_tid = a[0];
+    rv = me->tid();
+#ifndef SPIKE
+    mark_tls(me->s.xrf[4]);	// libc calls it right after setting up main thread tp
+#endif
+  }
+  else if (sysnum == SYS_exit && me->tid() != getpid()) {
+    if (conf_ecall())
+      fprintf(stderr, " thread exit\n");
+    exit_thread(me);
+  }
+  else if (sched_active()) {	// may block, let other harts run
+    sched_block();
+    rv = host_syscall(sysnum, a[0], a[1], a[2], a[3], a[4], a[5]);
+    sched_unblock();
+  }
+  else
+    rv = host_syscall(sysnum, a[0], a[1], a[2], a[3], a[4], a[5]);
+  return rv;
+}
+
 long proxy_syscall(long rvnum, long a0, long a1, long a2, long a3, long a4, long a5, hart_t* me)
 {
   if (rvnum<0 || rvnum>HIGHEST_ECALL_NUM || !rv_to_host[rvnum].name) {
@@ -105,15 +394,18 @@ long proxy_syscall(long rvnum, long a0, long a1, long a2, long a3, long a4, long
   }
   //fprintf(stderr, "ecall %ld --> x86 syscall %ld %s\n", rvnum, sysnum, name);
   if (conf_ecall()) {
-    int tid = gettid();
+    int tid = me->tid();
     fprintf(stderr, "[%d] Ecall %s( %ld(0x%lx), %ld(0x%lx), %ld(0x%lx), %ld(0x%lx) )", tid, name, a0, a0, a1, a1, a2, a2, a3, a3);
   }
+  long a[6] = { a0, a1, a2, a3, a4, a5 };
   long rv;
-  if (sysnum == SYS_clone)
-    //    s.xrf[10] = hart_pointer->clone(hart_pointer, (long*)s.xrf+10);
-    rv = me->clone(me);
+  long begin = conf_sysprof() ? host_ns(CLOCK_MONOTONIC) : 0;
+  if (sequenced)
+    rv = sequence_syscall(me, sysnum, a, perform_syscall);
   else
-    rv = host_syscall(sysnum, a0, a1, a2, a3, a4, a5);
+    rv = perform_syscall(me, sysnum, a);
+  if (conf_sysprof())
+    profile_syscall(me, rvnum, sysnum, rv, host_ns(CLOCK_MONOTONIC)-begin);
   if (conf_ecall())
     fprintf(stderr, " -> %ld(0x%lx)\n", rv, rv);
   return rv;
@@ -156,9 +448,9 @@ uintptr_t host_syscall(int sysnum, uintptr_t a0, uintptr_t a1, uintptr_t a2, uin
     fprintf(stderr, "Simulator must handle clones!\n");
     abort();
 
-    //  case SYS_mmap:
-    //    fprintf(stderr, "mmap flag MAP_FIXED=%d\n", (a[3]&MAP_FIXED)!=0);
-    //    break;
+  case SYS_mmap:
+    a0 = mmap_hint(a0, a3);
+    break;
 
 #if 1
   case SYS_open:
@@ -174,26 +466,35 @@ uintptr_t host_syscall(int sysnum, uintptr_t a0, uintptr_t a1, uintptr_t a2, uin
     ;
   }
   retval = asm_syscall(sysnum, a0, a1, a2, a3, a4, a5);
+  if ((unsigned long)retval > -4096UL)	// error
+    return retval;
+  // keep track of guest memory for checkpoints
+#define PGUP(n)  (((n)+4095) & ~4095L)
+  switch (sysnum) {
+  case SYS_mmap:
+    region_add(retval, retval+PGUP(a1), a2, (a3&MAP_ANONYMOUS)!=0, (a3&MAP_ANONYMOUS) ? Region_mmap : Region_file);
+    mmap_done(retval, a1, a3);
+    break;
+  case SYS_munmap:
+    region_remove(a0, a0+PGUP(a1));
+    break;
+  case SYS_mremap:
+    region_move(a0, a0+PGUP(a1), retval, retval+PGUP(a2));
+    break;
+  case SYS_mprotect:
+    region_protect(a0, a0+PGUP(a1), a2);
+    break;
+  }
   return retval;
 
  stop:
-  // main process tid is last on list
-  int main_tid = 0;
-  for (hart_t* p=hart_t::list(); p; p=p->next())
-    main_tid = p->tid();
-  if (gettid() != main_tid) {
-    while (1)
-      sleep(1000);
-  }
+  // exit_group from any thread ends the process
   exit(a0);
 }
 
 
 
 
-
-#define futex(a, b, c)  syscall(SYS_futex, a, b, c, 0, 0, 0)
-
 /*
   RISC-V clone system call arguments not same as wrapper or X86_64:
   a0 = flags
@@ -203,28 +504,63 @@ uintptr_t host_syscall(int sysnum, uintptr_t a0, uintptr_t a1, uintptr_t a2, uin
   a4 = child_tidptr
 */
 
-void thread_interpreter(hart_t* me)
+// child hart begins after clone ecall with its own stack and tls
+static void setup_child(hart_t* me)
 {
-  me->_tid = gettid();
-  futex(&me->_tid, FUTEX_WAKE, 1);
-
 #ifdef SPIKE
   processor_t* p = &me->s.spike_cpu;
+  long flags = READ_REG(10);
+  int* ptid = (int*)READ_REG(12);
+  int* ctid = (int*)READ_REG(14);
+#else
+  long flags = me->s.xrf[10];
+  int* ptid = (int*)me->s.xrf[12];
+  int* ctid = (int*)me->s.xrf[14];
+#endif
+  // tid pointers must be set before parent returns from clone
+  if (flags & CLONE_PARENT_SETTID)
+    *ptid = me->tid();
+  if (flags & CLONE_CHILD_SETTID)
+    *ctid = me->tid();
+  if (flags & CLONE_CHILD_CLEARTID)
+    me->clear_child_tid = (uintptr_t)ctid;
+#ifdef SPIKE
   WRITE_REG(2, READ_REG(11));	// a1 = child_stack
   WRITE_REG(4, READ_REG(13));	// a3 = tls
   WRITE_REG(10, 0);		// indicate child thread
 #else
   me->s.xrf[2] = me->s.xrf[11]; // a1 = child_stack
   me->s.xrf[4] = me->s.xrf[13]; // a3 = tls
+  if (flags & CLONE_SETTLS)
+    mark_tls(me->s.xrf[4]);
   me->s.xrf[10] = 0;		// indicate child thread
 #endif
   me->pc += 4;			// skip over ecall
-  me->interpreter(me);
 }
 
+void thread_interpreter(hart_t* me)
+{
+  pin_thread(me->number());	// before hart touches any memory
+  me->set_tid(gettid());
+  setup_child(me);
+  futex(&me->_tid, FUTEX_WAKE, 1);
+  if (setjmp(thread_exit) == 0)
+    me->interpreter(me);
+  // host thread ends, hart_t lives on in pool
+}
+
+#define VIRTUAL_TID  (1<<22)	// above Linux pid_max, never a host tid
+static int virtual_tid = VIRTUAL_TID;
+
 int clone_thread(hart_t* child)
 {
   fprintf(stderr, "clone_thread called\n");
+  if (conf_workers()) {		// M:N scheduled, no host thread of its own
+    child->set_tid(__sync_fetch_and_add(&virtual_tid, 1));
+    setup_child(child);
+    sched_spawn(child);
+    return child->_tid;
+  }
   child->_tid = 0;		// acts as futex lock
   std::thread t(thread_interpreter, child);
   while (child->_tid == 0)
@@ -0,0 +1,480 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/times.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <sys/sysinfo.h>
+#include <sys/statfs.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <vector>
+
+#include "caveat.h"
+#include "hart.h"
+#include "scheduler.h"
+#include "record.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+option<> conf_record  ("record",	0,		"Record system calls and atomic order to file");
+option<> conf_playback("playback",	0,		"Play back system calls and atomic order from recorded file");
+
+/*
+  Log file is
+
+    record_header_t
+    events		record_event_t
+			  EV_SYSCALL is followed by record_result_t and
+			  for each write record_write_t, bytes padded to 8
+
+  in the order the events happened.  Clone and exit also log EV_BEGIN
+  before the call, so events of a new hart come after its creation and
+  nothing a hart does follows its exit.
+*/
+
+#define RECORD_MAGIC	0x6f63657261766163L	// "cavareco"
+#define RECORD_VERSION	1
+
+#define EV_ATOMIC	0	// AMO or store conditional
+#define EV_BEGIN	1	// system call about to be performed
+#define EV_SYSCALL	2	// system call completed
+
+struct record_header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t pad;
+};
+
+struct record_event_t {
+  uint32_t hart;		// hart_t::number()
+  uint16_t kind;
+  uint16_t sysnum;		// host system call number
+};
+
+struct record_result_t {
+  int64_t rv;
+  uint64_t writes;
+};
+
+struct record_write_t {
+  uint64_t addr;
+  uint64_t len;
+};
+
+bool sequenced;			// --record or --playback in effect
+
+static pthread_mutex_t seq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seq_turn = PTHREAD_COND_INITIALIZER;
+static long events;
+
+static FILE* log_file;		// recording, 0 after closed
+static FILE* play_file;		// playback
+static record_event_t next_event; // read ahead, says whose turn it is
+static bool log_ended;
+
+#define ROUND8(n)  (((n)+7) & ~7L)
+#define FAILED(rv) ((unsigned long)(rv) > -4096UL)
+
+
+/*
+  Guest memory written by the kernel is known only for system calls
+  listed here.  Anything else is assumed to return just a value.
+*/
+
+struct effect_t {
+  uintptr_t addr;
+  long len;
+};
+
+static void out(std::vector<effect_t>& e, long addr, long len)
+{
+  if (addr && len > 0)
+    e.push_back({(uintptr_t)addr, len});
+}
+
+static void scatter(std::vector<effect_t>& e, const struct iovec* iov, long n, long bytes)
+{
+  for (long k=0; k<n && bytes>0; k++) {
+    long len = (long)iov[k].iov_len < bytes ? iov[k].iov_len : bytes;
+    out(e, (long)iov[k].iov_base, len);
+    bytes -= len;
+  }
+}
+
+static void effects(long sysnum, long* a, long rv, std::vector<effect_t>& e)
+{
+  if (FAILED(rv))
+    return;
+  switch (sysnum) {
+  case SYS_read:
+  case SYS_pread64:
+  case SYS_getdents64:
+    out(e, a[1], rv);
+    break;
+  case SYS_readv:
+  case SYS_preadv:
+    scatter(e, (struct iovec*)a[1], a[2], rv);
+    break;
+  case SYS_readlinkat:
+  case SYS_sched_getaffinity:
+    out(e, a[2], rv);
+    break;
+  case SYS_getrandom:
+  case SYS_getcwd:
+    out(e, a[0], rv);
+    break;
+  case SYS_fstat:
+    out(e, a[1], sizeof(struct stat));
+    break;
+  case SYS_newfstatat:
+    out(e, a[2], sizeof(struct stat));
+    break;
+  case SYS_statx:
+    out(e, a[4], sizeof(struct statx));
+    break;
+  case SYS_statfs:
+  case SYS_fstatfs:
+    out(e, a[1], sizeof(struct statfs));
+    break;
+  case SYS_uname:
+    out(e, a[0], sizeof(struct utsname));
+    break;
+  case SYS_sysinfo:
+    out(e, a[0], sizeof(struct sysinfo));
+    break;
+  case SYS_times:
+    out(e, a[0], sizeof(struct tms));
+    break;
+  case SYS_getrusage:
+    out(e, a[1], sizeof(struct rusage));
+    break;
+  case SYS_clock_gettime:
+  case SYS_clock_getres:
+    out(e, a[1], sizeof(struct timespec));
+    break;
+  case SYS_gettimeofday:
+    out(e, a[0], sizeof(struct timeval));
+    break;
+  case SYS_getrlimit:
+    out(e, a[1], sizeof(struct rlimit));
+    break;
+  case SYS_prlimit64:
+    out(e, a[3], sizeof(struct rlimit));
+    break;
+  case SYS_rt_sigaction:	// kernel struct sigaction: handler, flags, restorer, mask
+    out(e, a[2], 3*sizeof(long)+a[3]);
+    break;
+  case SYS_rt_sigprocmask:
+    out(e, a[2], a[3]);
+    break;
+  case SYS_pipe2:
+    out(e, a[0], 2*sizeof(int));
+    break;
+  case SYS_socketpair:
+    out(e, a[3], 2*sizeof(int));
+    break;
+  case SYS_wait4:
+    out(e, a[1], sizeof(int));
+    out(e, a[3], sizeof(struct rusage));
+    break;
+  case SYS_waitid:
+    out(e, a[2], sizeof(siginfo_t));
+    out(e, a[4], sizeof(struct rusage));
+    break;
+  case SYS_ioctl:
+    if (a[1] == TCGETS)
+      out(e, a[2], 36);		// kernel struct termios
+    else if (a[1] == TIOCGWINSZ)
+      out(e, a[2], sizeof(struct winsize));
+    else if (a[1] == FIONREAD)
+      out(e, a[2], sizeof(int));
+    break;
+  case SYS_getcpu:
+    out(e, a[0], sizeof(unsigned));
+    out(e, a[1], sizeof(unsigned));
+    break;
+  case SYS_getresuid:
+  case SYS_getresgid:
+    out(e, a[0], sizeof(unsigned));
+    out(e, a[1], sizeof(unsigned));
+    out(e, a[2], sizeof(unsigned));
+    break;
+  case SYS_getgroups:
+    if (a[0] > 0)
+      out(e, a[1], rv*sizeof(unsigned));
+    break;
+  case SYS_epoll_pwait:
+    out(e, a[1], rv*sizeof(struct epoll_event));
+    break;
+  case SYS_ppoll:
+    out(e, a[0], a[1]*sizeof(struct pollfd));
+    break;
+  case SYS_pselect6:
+    out(e, a[1], (a[0]+7)/8);
+    out(e, a[2], (a[0]+7)/8);
+    out(e, a[3], (a[0]+7)/8);
+    break;
+  case SYS_recvfrom:
+    out(e, a[1], rv);
+    if (a[5]) {
+      out(e, a[5], sizeof(socklen_t));
+      out(e, a[4], *(socklen_t*)a[5]);
+    }
+    break;
+  case SYS_recvmsg:
+    {
+      struct msghdr* m = (struct msghdr*)a[1];
+      out(e, a[1], sizeof(struct msghdr));
+      scatter(e, m->msg_iov, m->msg_iovlen, rv);
+      out(e, (long)m->msg_name, m->msg_namelen);
+      out(e, (long)m->msg_control, m->msg_controllen);
+    }
+    break;
+  case SYS_accept:
+  case SYS_accept4:
+  case SYS_getsockname:
+  case SYS_getpeername:
+    if (a[2]) {
+      out(e, a[2], sizeof(socklen_t));
+      out(e, a[1], *(socklen_t*)a[2]);
+    }
+    break;
+  case SYS_getsockopt:
+    if (a[4]) {
+      out(e, a[4], sizeof(socklen_t));
+      out(e, a[3], *(socklen_t*)a[4]);
+    }
+    break;
+  case SYS_clone:		// tid stored by setup_child()
+    if (a[0] & CLONE_PARENT_SETTID)
+      out(e, a[2], sizeof(int));
+    if (a[0] & CLONE_CHILD_SETTID)
+      out(e, a[4], sizeof(int));
+    break;
+  case SYS_mmap:		// playback has no file, keep readable contents
+    if (!(a[3] & MAP_ANONYMOUS) && (a[2] & PROT_READ)) {
+      struct stat st;
+      if (fstat(a[4], &st) == 0 && st.st_size > a[5])
+	out(e, rv, st.st_size-a[5] < a[1] ? st.st_size-a[5] : a[1]);
+    }
+    break;
+  }
+}
+
+
+// recording, caller holds seq_lock
+static void log_event(hart_t* h, int kind, long sysnum)
+{
+  events++;
+  if (!log_file)
+    return;
+  record_event_t ev = { (uint32_t)h->number(), (uint16_t)kind, (uint16_t)sysnum };
+  fwrite(&ev, sizeof ev, 1, log_file);
+}
+
+static void log_result(long rv, std::vector<effect_t>& e)
+{
+  if (!log_file)
+    return;
+  record_result_t r = { rv, e.size() };
+  fwrite(&r, sizeof r, 1, log_file);
+  static const char zeros[8] = { 0 };
+  for (effect_t& w : e) {
+    record_write_t rw = { w.addr, (uint64_t)w.len };
+    fwrite(&rw, sizeof rw, 1, log_file);
+    fwrite((void*)w.addr, 1, w.len, log_file);
+    fwrite(zeros, 1, ROUND8(w.len)-w.len, log_file);
+  }
+}
+
+static void record_close()
+{
+  pthread_mutex_lock(&seq_lock);
+  if (log_file) {
+    dieif(fclose(log_file), "write %s failed", conf_record());
+    log_file = 0;
+    fprintf(stderr, "Recorded %ld events to %s\n", events, conf_record());
+  }
+  pthread_mutex_unlock(&seq_lock);
+}
+
+
+// playback, hart is running only when it has the next event
+static bool my_turn(hart_t* h)
+{
+  quitif(log_ended, "Playback %s ended after %ld events", conf_playback(), events);
+  return next_event.hart == h->number();
+}
+
+static void await_turn(hart_t* h, int kind, long sysnum)
+{
+  pthread_mutex_lock(&seq_lock);
+  if (!my_turn(h) && sched_active()) { // let other harts have this worker
+    pthread_mutex_unlock(&seq_lock);
+    sched_block();
+    pthread_mutex_lock(&seq_lock);
+    while (!my_turn(h))
+      pthread_cond_wait(&seq_turn, &seq_lock);
+    pthread_mutex_unlock(&seq_lock);
+    sched_unblock();
+    pthread_mutex_lock(&seq_lock);
+  }
+  while (!my_turn(h))
+    pthread_cond_wait(&seq_turn, &seq_lock);
+  pthread_mutex_unlock(&seq_lock);
+  quitif(next_event.kind!=kind || (kind!=EV_ATOMIC && next_event.sysnum!=sysnum),
+	 "Playback diverged at event %ld: hart %d expected kind %d syscall %d, not kind %d syscall %ld",
+	 events, h->number(), next_event.kind, next_event.sysnum, kind, sysnum);
+}
+
+static void playback_read(void* buf, long len)
+{
+  quitif(fread(buf, 1, len, play_file) != len, "Playback %s truncated", conf_playback());
+}
+
+// done with current event, read ahead to find whose turn is next
+static void advance()
+{
+  pthread_mutex_lock(&seq_lock);
+  log_ended = fread(&next_event, sizeof next_event, 1, play_file) != 1;
+  events++;
+  pthread_cond_broadcast(&seq_turn);
+  pthread_mutex_unlock(&seq_lock);
+}
+
+static long playback_syscall(hart_t* me, long sysnum, long* a, performfunc_t perform)
+{
+  if (sysnum==SYS_clone || sysnum==SYS_exit || sysnum==SYS_exit_group) {
+    await_turn(me, EV_BEGIN, sysnum);
+    advance();
+    if (sysnum != SYS_clone)
+      return perform(me, sysnum, a);
+    perform(me, sysnum, a);	// child tid is the recorded one
+  }
+  await_turn(me, EV_SYSCALL, sysnum);
+  record_result_t r;
+  playback_read(&r, sizeof r);
+  long rv = r.rv;
+  long b[6];
+  memcpy(b, a, sizeof b);
+  bool file = false;
+  // address space must come out the same
+  switch (FAILED(rv) ? -1 : sysnum) {
+  case SYS_mmap:			// never on top of simulator memory
+    b[0] = rv;
+    if (!(a[3] & MAP_FIXED))
+      b[3] |= MAP_FIXED_NOREPLACE;
+    if (!(a[3] & MAP_ANONYMOUS)) { // contents are in the log
+      file = true;
+      b[2] |= PROT_WRITE;
+      b[3] = (b[3] & (MAP_FIXED|MAP_FIXED_NOREPLACE)) | MAP_PRIVATE|MAP_ANONYMOUS;
+      b[4] = -1;
+      b[5] = 0;
+    }
+    quitif(perform(me, sysnum, b) != rv, "Playback mmap not at %lx, record and play back with setarch -R", rv);
+    break;
+  case SYS_mremap:
+    b[3] |= MREMAP_MAYMOVE|MREMAP_FIXED;
+    b[4] = rv;
+    quitif(perform(me, sysnum, b) != rv, "Playback mremap not at %lx, record and play back with setarch -R", rv);
+    break;
+  case SYS_brk:
+    quitif(perform(me, sysnum, b) != rv, "Playback brk not at %lx", rv);
+    break;
+  case SYS_munmap:
+  case SYS_mprotect:
+  case SYS_madvise:
+  case SYS_set_tid_address:
+    perform(me, sysnum, b);
+    break;
+  }
+  for (uint64_t k=0; k<r.writes; k++) { // directly into guest memory
+    record_write_t w;
+    char pad[8];
+    playback_read(&w, sizeof w);
+    playback_read((void*)w.addr, w.len);
+    playback_read(pad, ROUND8(w.len)-w.len);
+  }
+  if (file && !(a[2] & PROT_WRITE))
+    mprotect((void*)rv, a[1], a[2]);
+  advance();
+  return rv;
+}
+
+long sequence_syscall(hart_t* me, long sysnum, long* a, performfunc_t perform)
+{
+  if (conf_playback())
+    return playback_syscall(me, sysnum, a, perform);
+  if (sysnum==SYS_clone || sysnum==SYS_exit || sysnum==SYS_exit_group) {
+    pthread_mutex_lock(&seq_lock);
+    log_event(me, EV_BEGIN, sysnum);
+    pthread_mutex_unlock(&seq_lock);
+  }
+  long rv = perform(me, sysnum, a); // may block, so not holding lock
+  std::vector<effect_t> e;
+  effects(sysnum, a, rv, e);
+  pthread_mutex_lock(&seq_lock);
+  log_event(me, EV_SYSCALL, sysnum);
+  log_result(rv, e);
+  pthread_mutex_unlock(&seq_lock);
+  return rv;
+}
+
+
+// atomic memory operations, called from hart_t templates
+void sequence_begin(hart_t* h)
+{
+  if (conf_playback())
+    await_turn(h, EV_ATOMIC, 0);
+  else
+    pthread_mutex_lock(&seq_lock);
+}
+
+void sequence_end(hart_t* h)
+{
+  if (conf_playback())
+    advance();
+  else {
+    log_event(h, EV_ATOMIC, 0);
+    pthread_mutex_unlock(&seq_lock);
+  }
+}
+
+
+void record_open()
+{
+  quitif(conf_record() && conf_playback(), "--record and --playback cannot be used together");
+  if (conf_record()) {
+    log_file = fopen(conf_record(), "w");
+    quitif(!log_file, "Cannot open record file %s", conf_record());
+    setvbuf(log_file, 0, _IOFBF, 1<<20);
+    record_header_t rh = { RECORD_MAGIC, RECORD_VERSION, 0 };
+    fwrite(&rh, sizeof rh, 1, log_file);
+    atexit(record_close);
+  }
+  else {			// same buffering as recording, so host memory layout matches
+    play_file = fopen(conf_playback(), "r");
+    quitif(!play_file, "Cannot open playback file %s", conf_playback());
+    setvbuf(play_file, 0, _IOFBF, 1<<20);
+    record_header_t rh;
+    quitif(fread(&rh, sizeof rh, 1, play_file)!=1 || rh.magic!=RECORD_MAGIC || rh.version!=RECORD_VERSION,
+	   "%s is not a record file", conf_playback());
+    log_ended = fread(&next_event, sizeof next_event, 1, play_file) != 1;
+  }
+  sequenced = true;
+}
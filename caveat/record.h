@@ -0,0 +1,23 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Deterministic record and playback of a multithreaded guest.  Recording
+  logs the result of every system call together with the guest memory
+  the kernel wrote, and the global order of system calls and atomic
+  memory operations (AMOs and store conditionals) across harts.
+  Playback runs harts in exactly that order and answers system calls
+  from the log without touching the host, except that memory management
+  and thread system calls are performed again to recreate the address
+  space and harts.  Plain loads and stores are not ordered, so a guest
+  with data races may still diverge.
+*/
+
+extern option<> conf_record;
+extern option<> conf_playback;
+
+typedef long (*performfunc_t)(hart_t* me, long sysnum, long* a);
+
+void record_open();		// --record or --playback, before guest runs
+long sequence_syscall(hart_t* me, long sysnum, long* a, performfunc_t perform);
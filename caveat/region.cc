@@ -0,0 +1,150 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <pthread.h>
+#include <sys/mman.h>
+#include <map>
+
+#include "caveat.h"
+#include "region.h"
+
+const char* region_name[] = { "text", "data", "heap", "stack", "mmap", "file", "tls", "unknown" };
+
+static map<uintptr_t, region_t> regions; // keyed by begin
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint8_t* volatile region_radix[1<<REGION_ROOT_BITS];
+
+// set kind of every page in [begin,end), call holding regions_lock
+static void paint(uintptr_t begin, uintptr_t end, region_kind_t kind)
+{
+  const uintptr_t leaf_pages = 1L << REGION_LEAF_BITS;
+  uintptr_t last = end >> REGION_PAGE_BITS;
+  dieif(last > (1L << (REGION_ROOT_BITS+REGION_LEAF_BITS)), "region %lx-%lx beyond 48 bits", begin, end);
+  for (uintptr_t pg=begin>>REGION_PAGE_BITS; pg<last; ) {
+    uintptr_t n = leaf_pages - pg%leaf_pages;
+    if (n > last-pg)
+      n = last-pg;
+    uint8_t* leaf = region_radix[pg >> REGION_LEAF_BITS];
+    if (!leaf && kind != Region_unknown) {
+      leaf = (uint8_t*)mmap(0, leaf_pages, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      dieif(leaf==MAP_FAILED, "region radix leaf mmap failed");
+      memset(leaf, Region_unknown, leaf_pages);
+      __atomic_store_n(&region_radix[pg >> REGION_LEAF_BITS], leaf, __ATOMIC_RELEASE);
+    }
+    if (leaf)
+      memset(leaf + pg%leaf_pages, kind, n);
+    pg += n;
+  }
+}
+
+// cut [begin,end) out of every region, splitting where necessary
+static void carve(uintptr_t begin, uintptr_t end)
+{
+  auto it = regions.lower_bound(begin);
+  if (it != regions.begin() && prev(it)->second.end > begin)
+    --it;
+  while (it != regions.end() && it->second.begin < end) {
+    region_t r = it->second;
+    it = regions.erase(it);
+    if (r.begin < begin) {
+      region_t lo = r;
+      lo.end = begin;
+      regions[lo.begin] = lo;
+    }
+    if (r.end > end) {
+      region_t hi = r;
+      hi.begin = end;
+      regions[hi.begin] = hi;
+      break;
+    }
+  }
+}
+
+void region_add(uintptr_t begin, uintptr_t end, int prot, bool anonymous, region_kind_t kind)
+{
+  if (begin >= end)
+    return;
+  pthread_mutex_lock(&regions_lock);
+  carve(begin, end);
+  regions[begin] = { begin, end, prot, anonymous, kind };
+  paint(begin, end, kind);
+  pthread_mutex_unlock(&regions_lock);
+}
+
+void region_remove(uintptr_t begin, uintptr_t end)
+{
+  pthread_mutex_lock(&regions_lock);
+  carve(begin, end);
+  paint(begin, end, Region_unknown);
+  pthread_mutex_unlock(&regions_lock);
+}
+
+void region_protect(uintptr_t begin, uintptr_t end, int prot)
+{
+  pthread_mutex_lock(&regions_lock);
+  vector<region_t> changed;
+  for (auto it=regions.begin(); it!=regions.end(); ++it) {
+    region_t r = it->second;
+    if (r.end <= begin || r.begin >= end)
+      continue;
+    if (r.begin < begin) r.begin = begin;
+    if (r.end > end) r.end = end;
+    r.prot = prot;
+    changed.push_back(r);
+  }
+  for (region_t& r : changed) {
+    carve(r.begin, r.end);
+    regions[r.begin] = r;
+  }
+  pthread_mutex_unlock(&regions_lock);
+}
+
+void region_move(uintptr_t from, uintptr_t fromend, uintptr_t to, uintptr_t toend)
+{
+  pthread_mutex_lock(&regions_lock);
+  region_t r = { to, toend, PROT_READ|PROT_WRITE, true, Region_mmap };
+  auto it = regions.upper_bound(from);
+  if (it != regions.begin() && (--it)->second.end > from) {
+    r.prot = it->second.prot;
+    r.anonymous = it->second.anonymous;
+    r.kind = it->second.kind;
+  }
+  carve(from, fromend);
+  paint(from, fromend, Region_unknown);
+  carve(to, toend);
+  regions[to] = r;
+  paint(to, toend, r.kind);
+  pthread_mutex_unlock(&regions_lock);
+}
+
+void region_relabel(uintptr_t begin, uintptr_t end, region_kind_t kind)
+{
+  pthread_mutex_lock(&regions_lock);
+  vector<region_t> changed;
+  for (auto it=regions.begin(); it!=regions.end(); ++it) {
+    region_t r = it->second;
+    if (r.end <= begin || r.begin >= end)
+      continue;
+    if (r.begin < begin) r.begin = begin;
+    if (r.end > end) r.end = end;
+    r.kind = kind;
+    changed.push_back(r);
+  }
+  for (region_t& r : changed) {
+    carve(r.begin, r.end);
+    regions[r.begin] = r;
+    paint(r.begin, r.end, kind);
+  }
+  pthread_mutex_unlock(&regions_lock);
+}
+
+vector<region_t> region_list()
+{
+  pthread_mutex_lock(&regions_lock);
+  vector<region_t> v;
+  for (auto& e : regions)
+    v.push_back(e.second);
+  pthread_mutex_unlock(&regions_lock);
+  return v;
+}
@@ -0,0 +1,46 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Guest memory lives in the simulator's own address space, so the only
+  record of which host pages belong to the guest is kept here.  The
+  loader, brk and the mmap family of system calls keep it up to date.
+
+  Every page is also classified in a two-level radix tree of one byte
+  region kinds, so region_of() is two loads and needs no lock.  Leaves
+  cover 1GB and are allocated when first painted.
+*/
+
+#include <stdint.h>
+#include <vector>
+
+enum region_kind_t { Region_text, Region_data, Region_heap, Region_stack, Region_mmap, Region_file, Region_tls,
+		     Region_unknown, Number_of_Regions };
+extern const char* region_name[];
+
+#define REGION_PAGE_BITS  12
+#define REGION_LEAF_BITS  18
+#define REGION_ROOT_BITS  (48-REGION_PAGE_BITS-REGION_LEAF_BITS)
+
+extern uint8_t* volatile region_radix[1<<REGION_ROOT_BITS];
+
+static inline region_kind_t region_of(uintptr_t a)
+{
+  uint8_t* leaf = region_radix[(a >> (REGION_PAGE_BITS+REGION_LEAF_BITS)) & ((1<<REGION_ROOT_BITS)-1)];
+  return leaf ? (region_kind_t)leaf[(a >> REGION_PAGE_BITS) & ((1<<REGION_LEAF_BITS)-1)] : Region_unknown;
+}
+
+struct region_t {
+  uintptr_t begin, end;		// page aligned
+  int prot;			// PROT_READ etc.
+  bool anonymous;		// not backed by a file
+  region_kind_t kind;
+};
+
+void region_add(uintptr_t begin, uintptr_t end, int prot, bool anonymous, region_kind_t kind);
+void region_remove(uintptr_t begin, uintptr_t end);
+void region_protect(uintptr_t begin, uintptr_t end, int prot);
+void region_move(uintptr_t from, uintptr_t fromend, uintptr_t to, uintptr_t toend);
+void region_relabel(uintptr_t begin, uintptr_t end, region_kind_t kind); // mapped parts only
+std::vector<region_t> region_list();	// sorted by address
@@ -0,0 +1,343 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <limits.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <deque>
+
+#include "caveat.h"
+#include "hart.h"
+#include "scheduler.h"
+#include "affinity.h"
+
+option<int>  conf_workers("workers",	0, -1,		"M:N schedule guest threads on this many host threads, no value=all cores");
+option<long> conf_slice  ("slice",	100000,		"Instructions before switching M:N scheduled harts");
+
+#define FIBER_STACK  (1<<20)	// reserved, only touched pages are allocated
+
+/*
+  A worker is a run slot: only the host thread that owns it may execute
+  guest code.  A host thread entering a system call keeps its slot if
+  nothing is waiting to run, otherwise hands the slot to a spare thread.
+  On return it takes back its slot, or one left idle by another blocked
+  thread, or else queues its hart and becomes a spare itself.
+*/
+
+struct fiber_t {
+  ucontext_t ctx;
+  hart_t* h;
+  void* stack;			// 0 if hart uses original host thread stack
+};
+
+struct host_t;
+
+struct worker_t {
+  pthread_mutex_t lock;		// protects queue
+  deque<fiber_t*> queue;	// runnable harts, owner takes front, thieves take back
+  host_t* owner;		// host thread holding this slot
+  bool in_syscall;		// owner blocked in host system call, slot can be taken
+};
+
+enum after_t { Yielded, Parked, Exited };
+
+struct host_t {
+  ucontext_t home;		// scheduler loop
+  worker_t* w;			// run slot held, 0=spare thread
+  worker_t* pinned;		// on CPU of this slot
+  fiber_t* running;		// hart currently executing
+  after_t after;		// why running fiber switched back to home
+  pthread_cond_t wake;
+  host_t* next;			// on spares or idlers list
+};
+
+static int nworkers;
+static worker_t* workers;	// 0 until first clone
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static deque<fiber_t*> global_queue; // harts back from system call without a slot
+static host_t* spares;		// host threads without a slot
+static host_t* idlers;		// host threads with a slot but nothing to run
+static volatile long runnable;	// harts waiting in any queue
+static thread_local host_t* self;
+
+// fibers migrate between host threads, so never cache address of self
+static host_t* __attribute__((noipa)) current_host() { return self; }
+
+bool sched_active()
+{
+  return workers != 0;
+}
+
+static void* new_stack()
+{
+  void* stk = mmap(0, FIBER_STACK, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  dieif(stk==MAP_FAILED, "cannot allocate fiber stack");
+  return stk;
+}
+
+static host_t* new_host(worker_t* w)
+{
+  host_t* t = new host_t;
+  t->w = w;
+  t->pinned = 0;
+  t->running = 0;
+  pthread_cond_init(&t->wake, 0);
+  t->next = 0;
+  if (w)
+    w->owner = t;
+  return t;
+}
+
+static void unlink_host(host_t** list, host_t* t)
+{
+  for (host_t** pp=list; *pp; pp=&(*pp)->next)
+    if (*pp == t) {
+      *pp = t->next;
+      return;
+    }
+}
+
+// call holding sched_lock
+static void wake_idler()
+{
+  host_t* t = idlers;
+  if (t) {
+    idlers = t->next;
+    pthread_cond_signal(&t->wake);
+  }
+}
+
+static fiber_t* find_work(worker_t* w)
+{
+  fiber_t* f = 0;
+  pthread_mutex_lock(&w->lock);
+  if (!w->queue.empty()) {
+    f = w->queue.front();
+    w->queue.pop_front();
+  }
+  pthread_mutex_unlock(&w->lock);
+  if (!f && !global_queue.empty()) {
+    pthread_mutex_lock(&sched_lock);
+    if (!global_queue.empty()) {
+      f = global_queue.front();
+      global_queue.pop_front();
+    }
+    pthread_mutex_unlock(&sched_lock);
+  }
+  for (int k=1; !f && k<nworkers; k++) {
+    worker_t* v = &workers[(w-workers+k) % nworkers];
+    pthread_mutex_lock(&v->lock);
+    if (!v->queue.empty()) {
+      f = v->queue.back();
+      v->queue.pop_back();
+    }
+    pthread_mutex_unlock(&v->lock);
+  }
+  if (f)
+    __sync_fetch_and_sub(&runnable, 1);
+  return f;
+}
+
+static void push_local(worker_t* w, fiber_t* f)
+{
+  pthread_mutex_lock(&w->lock);
+  w->queue.push_back(f);
+  pthread_mutex_unlock(&w->lock);
+  __sync_fetch_and_add(&runnable, 1);
+}
+
+// what to do with fiber that just switched back to home context
+static void put_away(fiber_t* f, after_t after)
+{
+  switch (after) {
+  case Yielded:
+    push_local(self->w, f);
+    break;
+  case Parked:			// already counted in runnable
+    pthread_mutex_lock(&sched_lock);
+    global_queue.push_back(f);
+    wake_idler();
+    pthread_mutex_unlock(&sched_lock);
+    break;
+  case Exited:
+    if (f->stack)
+      munmap(f->stack, FIBER_STACK);
+    delete f;
+    break;
+  }
+}
+
+static void host_loop()
+{
+  for (;;) {
+    if (self->running) {	// main thread enters here first time with its hart
+      put_away(self->running, self->after);
+      self->running = 0;
+    }
+    if (!self->w) {		// spare thread waits to be given a slot
+      pthread_mutex_lock(&sched_lock);
+      self->next = spares;
+      spares = self;
+      while (!self->w)
+	pthread_cond_wait(&self->wake, &sched_lock);
+      pthread_mutex_unlock(&sched_lock);
+      continue;
+    }
+    if (self->pinned != self->w) { // follow slot to its CPU
+      pin_thread(self->w - workers);
+      self->pinned = self->w;
+    }
+    fiber_t* f = find_work(self->w);
+    if (!f) {
+      pthread_mutex_lock(&sched_lock);
+      if (runnable == 0) {
+	self->next = idlers;
+	idlers = self;
+	pthread_cond_wait(&self->wake, &sched_lock);
+	unlink_host(&idlers, self); // in case of spurious wakeup
+      }
+      pthread_mutex_unlock(&sched_lock);
+      continue;
+    }
+    self->running = f;
+    f->h->yield_at = f->h->executed() + conf_slice();
+    swapcontext(&self->home, &f->ctx);
+  }
+}
+
+static void* host_thread(void* arg)
+{
+  self = (host_t*)arg;
+  host_loop();
+  return 0;
+}
+
+static void start_host(host_t* t)
+{
+  pthread_t tnum;
+  dieif(pthread_create(&tnum, 0, host_thread, t), "failed to launch worker thread");
+  pthread_detach(tnum);
+}
+
+static void fiber_main()
+{
+  hart_t* h = current_host()->running->h;
+  h->interpreter(h);
+  sched_exit(h);
+}
+
+// first clone turns calling thread into worker 0, its hart continues on original stack
+static void start_workers(hart_t* h)
+{
+  nworkers = conf_workers() < 0 ? sysconf(_SC_NPROCESSORS_ONLN) : conf_workers();
+  worker_t* w = new worker_t[nworkers];
+  for (int k=0; k<nworkers; k++) {
+    pthread_mutex_init(&w[k].lock, 0);
+    w[k].owner = 0;
+    w[k].in_syscall = false;
+  }
+  host_t* t = new_host(&w[0]);
+  t->running = new fiber_t;
+  t->running->h = h;
+  t->running->stack = 0;
+  getcontext(&t->home);
+  t->home.uc_stack.ss_sp = new_stack();
+  t->home.uc_stack.ss_size = FIBER_STACK;
+  t->home.uc_link = 0;
+  makecontext(&t->home, host_loop, 0);
+  self = t;
+  h->yield_at = h->executed() + conf_slice();
+  workers = w;
+  for (int k=1; k<nworkers; k++)
+    start_host(new_host(&w[k]));
+}
+
+void sched_spawn(hart_t* child)
+{
+  if (!workers)			// only main hart exists before first clone
+    start_workers(hart_t::find(getpid()));
+  fiber_t* f = new fiber_t;
+  f->h = child;
+  f->stack = new_stack();
+  getcontext(&f->ctx);
+  f->ctx.uc_stack.ss_sp = f->stack;
+  f->ctx.uc_stack.ss_size = FIBER_STACK;
+  f->ctx.uc_link = 0;
+  makecontext(&f->ctx, fiber_main, 0);
+  push_local(current_host()->w, f);
+  pthread_mutex_lock(&sched_lock);
+  wake_idler();
+  pthread_mutex_unlock(&sched_lock);
+}
+
+void sched_yield_hart(hart_t* h)
+{
+  if (runnable == 0) {		// nobody waiting, keep going
+    h->yield_at = h->executed() + conf_slice();
+    return;
+  }
+  host_t* t = current_host();
+  t->after = Yielded;
+  swapcontext(&t->running->ctx, &t->home);
+}
+
+// hand slot to spare thread, call holding sched_lock
+static void handoff(worker_t* w)
+{
+  host_t* s = spares;
+  w->in_syscall = false;
+  if (s) {
+    spares = s->next;
+    s->w = w;
+    w->owner = s;
+    pthread_cond_signal(&s->wake);
+  }
+  else
+    start_host(new_host(w));
+}
+
+void sched_block()
+{
+  host_t* t = current_host();
+  pthread_mutex_lock(&sched_lock);
+  if (runnable > 0) {		// others must keep running while we block
+    handoff(t->w);
+    t->w = 0;
+  }
+  else
+    t->w->in_syscall = true;
+  pthread_mutex_unlock(&sched_lock);
+}
+
+void sched_unblock()
+{
+  host_t* t = current_host();
+  pthread_mutex_lock(&sched_lock);
+  if (t->w && t->w->owner == t) { // still have our slot
+    t->w->in_syscall = false;
+    pthread_mutex_unlock(&sched_lock);
+    return;
+  }
+  t->w = 0;
+  for (int k=0; k<nworkers; k++)
+    if (workers[k].in_syscall) { // take slot from another blocked thread
+      t->w = &workers[k];
+      t->w->owner = t;
+      t->w->in_syscall = false;
+      pthread_mutex_unlock(&sched_lock);
+      return;
+    }
+  __sync_fetch_and_add(&runnable, 1); // so nobody blocks holding a slot meanwhile
+  pthread_mutex_unlock(&sched_lock);
+  t->after = Parked;
+  swapcontext(&t->running->ctx, &t->home);
+}
+
+void sched_exit(hart_t* h)
+{
+  host_t* t = current_host();
+  t->after = Exited;
+  setcontext(&t->home);
+}
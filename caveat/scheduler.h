@@ -0,0 +1,21 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  M:N scheduling of guest harts onto a fixed number of host worker
+  threads.  Each hart runs on its own stack (a fiber) and is switched
+  at basic block boundaries when its time slice runs out.  A worker
+  whose hart is blocked in a host system call hands its run queue to
+  a spare host thread.  Idle workers steal from other run queues.
+*/
+
+extern option<int>  conf_workers;
+extern option<long> conf_slice;
+
+bool sched_active();			// harts are being M:N scheduled
+void sched_spawn(hart_t* child);	// make new hart runnable
+void sched_yield_hart(hart_t* h);	// time slice exhausted
+void sched_block();			// before host system call
+void sched_unblock();			// after host system call
+void sched_exit(hart_t* h);		// does not return
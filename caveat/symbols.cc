@@ -0,0 +1,466 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <elf.h>
+#include <algorithm>
+#include <vector>
+
+#include "caveat.h"
+#include "symbols.h"
+#include "affinity.h"
+
+struct symbol_t {
+  uintptr_t addr;
+  uint32_t size;
+  uint32_t name;		// offset in string table
+};
+
+struct line_t {
+  uintptr_t addr;
+  uint32_t file;		// index in files, 0=no line information
+  uint32_t line;
+};
+
+struct symfile_t {
+  char* filename;
+  uintptr_t bias;
+  const char* strings;		// mapped .strtab
+  symbol_t* sym;		// sorted by addr, one per address
+  long n;
+  uintptr_t lo, hi;		// [first symbol, end of last)
+  line_t* lines;		// sorted by addr, one per address
+  long nlines;
+  pthread_t loader;
+  bool running;
+};
+
+#define MAX_SYMFILES  8
+static symfile_t symfile[MAX_SYMFILES];
+static int symfiles;
+static int generation;		// bumped when loading finishes, invalidates last hits
+static volatile bool loaded = true;
+static pthread_mutex_t symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static std::vector<const char*> files(1, "??"); // source file names, all loaded ELF files
+
+static thread_local struct {
+  int generation;
+  uintptr_t lo, hi;		// pc range labelled by name
+  const char* name;
+} last;
+
+static thread_local struct {
+  int generation;
+  uintptr_t lo, hi;		// pc range with same source line
+  const line_t* row;
+} last_line;
+
+/*
+  DWARF .debug_line, versions 2 to 5.  Each compilation unit has a
+  header with its file table followed by a line number program, a
+  byte code for a state machine that emits (address, file, line) rows.
+*/
+
+#define DW_LNS_copy		1
+#define DW_LNS_advance_pc	2
+#define DW_LNS_advance_line	3
+#define DW_LNS_set_file		4
+#define DW_LNS_const_add_pc	8
+#define DW_LNS_fixed_advance_pc	9
+#define DW_LNE_end_sequence	1
+#define DW_LNE_set_address	2
+#define DW_LNCT_path		1
+#define DW_LNCT_directory_index	2
+#define DW_FORM_block		0x09
+#define DW_FORM_data1		0x0b
+#define DW_FORM_data2		0x05
+#define DW_FORM_data4		0x06
+#define DW_FORM_data8		0x07
+#define DW_FORM_data16		0x1e
+#define DW_FORM_string		0x08
+#define DW_FORM_strp		0x0e
+#define DW_FORM_udata		0x0f
+#define DW_FORM_line_strp	0x1f
+
+struct dwarf_t {
+  const uint8_t* p;
+  const uint8_t* end;
+  bool dwarf64;
+  const char* str;		// .debug_str
+  const char* line_str;		// .debug_line_str
+  
+  uint64_t u(int n) { uint64_t v=0; memcpy(&v, p, n); p+=n; return v; }
+  uint64_t offset() { return u(dwarf64 ? 8 : 4); }
+  uint64_t uleb() {
+    uint64_t v = 0;
+    for (int shift=0; p<end; shift+=7) {
+      uint8_t b = *p++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+	break;
+    }
+    return v;
+  }
+  int64_t sleb() {
+    int64_t v = 0;
+    int shift = 0;
+    uint8_t b = 0x80;
+    while (p<end && (b & 0x80)) {
+      b = *p++;
+      v |= (int64_t)(b & 0x7f) << shift;
+      shift += 7;
+    }
+    if (shift < 64 && (b & 0x40))
+      v |= -((int64_t)1 << shift);
+    return v;
+  }
+  const char* string() { const char* s=(const char*)p; p+=strlen(s)+1; return s; }
+  // attribute value of given form, strings returned in *s
+  uint64_t form(int f, const char** s) {
+    *s = 0;
+    switch (f) {
+    case DW_FORM_string:	*s = string(); return 0;
+    case DW_FORM_strp:		*s = str ? str+offset() : (offset(), "??"); return 0;
+    case DW_FORM_line_strp:	*s = line_str ? line_str+offset() : (offset(), "??"); return 0;
+    case DW_FORM_udata:		return uleb();
+    case DW_FORM_data1:		return u(1);
+    case DW_FORM_data2:		return u(2);
+    case DW_FORM_data4:		return u(4);
+    case DW_FORM_data8:		return u(8);
+    case DW_FORM_data16:	p+=16; return 0;
+    case DW_FORM_block:		p+=uleb(); return 0;
+    }
+    return 0;
+  }
+};
+
+static uint32_t add_file(const char* dir, const char* name)
+{
+  char* path;
+  if (name[0]=='/' || !dir || !*dir)
+    path = strdup(name);
+  else {
+    path = (char*)malloc(strlen(dir)+strlen(name)+2);
+    sprintf(path, "%s/%s", dir, name);
+  }
+  pthread_mutex_lock(&files_lock);
+  uint32_t n = files.size();
+  files.push_back(path);
+  pthread_mutex_unlock(&files_lock);
+  return n;
+}
+
+// one compilation unit, appending rows to v
+static void line_program(dwarf_t& d, uintptr_t bias, std::vector<line_t>& v)
+{
+  d.dwarf64 = false;
+  uint64_t length = d.u(4);
+  if (length == 0xffffffff) {
+    d.dwarf64 = true;
+    length = d.u(8);
+  }
+  const uint8_t* unit_end = d.p + length;
+  int version = d.u(2);
+  if (version < 2 || version > 5) {
+    d.p = unit_end;
+    return;
+  }
+  if (version >= 5)
+    d.p += 2;			// address and segment selector size
+  uint64_t header_length = d.offset();
+  const uint8_t* program = d.p + header_length;
+  int min_length = d.u(1);
+  if (version >= 4)
+    d.u(1);			// maximum operations per instruction, VLIW only
+  bool default_is_stmt = d.u(1);
+  int line_base = (int8_t)d.u(1);
+  int line_range = d.u(1);
+  int opcode_base = d.u(1);
+  const uint8_t* opcode_lengths = d.p - 1; // [1..opcode_base-1]
+  d.p += opcode_base-1;
+
+  std::vector<const char*> dirs;
+  std::vector<uint32_t> file;	// unit file number -> global index
+  if (version <= 4) {
+    dirs.push_back("");
+    while (*d.p)
+      dirs.push_back(d.string());
+    d.p++;
+    file.push_back(0);		// numbered from 1
+    while (*d.p) {
+      const char* name = d.string();
+      uint64_t dir = d.uleb();
+      d.uleb(), d.uleb();	// mtime, length
+      file.push_back(add_file(dir<dirs.size() ? dirs[dir] : 0, name));
+    }
+    d.p++;
+  }
+  else {
+    for (int pass=0; pass<2; pass++) { // directories then files
+      int formats = d.u(1);
+      uint64_t fmt[2*formats];
+      for (int k=0; k<2*formats; k++)
+	fmt[k] = d.uleb();
+      uint64_t count = d.uleb();
+      for (uint64_t n=0; n<count; n++) {
+	const char* name = "??";
+	uint64_t dir = 0;
+	for (int k=0; k<formats; k++) {
+	  const char* s;
+	  uint64_t x = d.form(fmt[2*k+1], &s);
+	  if (fmt[2*k] == DW_LNCT_path && s)
+	    name = s;
+	  else if (fmt[2*k] == DW_LNCT_directory_index)
+	    dir = x;
+	}
+	if (pass == 0)
+	  dirs.push_back(name);
+	else
+	  file.push_back(add_file(dir<dirs.size() ? dirs[dir] : 0, name));
+      }
+    }
+  }
+
+  d.p = program;
+  uintptr_t addr = 0;
+  uint64_t fileno = 1;
+  long line = 1;
+  auto emit = [&](bool end) {
+    uint32_t f = fileno<file.size() ? file[fileno] : 0;
+    v.push_back({ addr+bias, end ? 0 : f, end ? 0 : (uint32_t)line });
+  };
+  while (d.p < unit_end) {
+    int op = d.u(1);
+    if (op >= opcode_base) {
+      int adj = op - opcode_base;
+      addr += adj / line_range * min_length;
+      line += line_base + adj % line_range;
+      emit(false);
+      continue;
+    }
+    switch (op) {
+    case 0: {			// extended opcode
+      uint64_t len = d.uleb();
+      const uint8_t* next = d.p + len;
+      int sub = len ? d.u(1) : 0;
+      if (sub == DW_LNE_end_sequence) {
+	emit(true);
+	addr = 0, fileno = 1, line = 1;
+      }
+      else if (sub == DW_LNE_set_address)
+	addr = d.u(len-1);
+      d.p = next;
+      break;
+    }
+    case DW_LNS_copy:		emit(false); break;
+    case DW_LNS_advance_pc:	addr += d.uleb() * min_length; break;
+    case DW_LNS_advance_line:	line += d.sleb(); break;
+    case DW_LNS_set_file:	fileno = d.uleb(); break;
+    case DW_LNS_const_add_pc:	addr += (255-opcode_base) / line_range * min_length; break;
+    case DW_LNS_fixed_advance_pc: addr += d.u(2); break;
+    default:			// skip operands
+      for (int k=0; k<opcode_lengths[op]; k++)
+	d.uleb();
+    }
+  }
+  d.p = unit_end;
+}
+
+static void read_lines(symfile_t* f, char* base, Elf64_Shdr* sh, int shnum, const char* shstr)
+{
+  dwarf_t d;
+  memset(&d, 0, sizeof d);
+  Elf64_Shdr* debug_line = 0;
+  for (int i=0; i<shnum; i++) {
+    const char* name = shstr + sh[i].sh_name;
+    if (sh[i].sh_flags & SHF_COMPRESSED)
+      continue;
+    if (strcmp(name, ".debug_line") == 0)
+      debug_line = &sh[i];
+    else if (strcmp(name, ".debug_str") == 0)
+      d.str = base + sh[i].sh_offset;
+    else if (strcmp(name, ".debug_line_str") == 0)
+      d.line_str = base + sh[i].sh_offset;
+  }
+  if (!debug_line)
+    return;
+  std::vector<line_t> v;
+  d.p = (const uint8_t*)base + debug_line->sh_offset;
+  d.end = d.p + debug_line->sh_size;
+  while (d.p < d.end)
+    line_program(d, f->bias, v);
+  // sequence ends sort before rows starting next sequence at same address
+  std::stable_sort(v.begin(), v.end(), [](const line_t& a, const line_t& b) {
+    return a.addr < b.addr || a.addr == b.addr && a.line == 0 && b.line != 0; });
+  long n = 0;
+  for (long k=0; k<v.size(); k++) {	// last row at each address wins
+    if (n > 0 && v[n-1].addr == v[k].addr)
+      n--;
+    v[n++] = v[k];
+  }
+  f->nlines = n;
+  f->lines = new line_t[n];
+  std::copy(v.begin(), v.begin()+n, f->lines);
+}
+
+static void* symbol_loader(void* arg)
+{
+  symfile_t* f = (symfile_t*)arg;
+  pin_helper();
+  int fd = open(f->filename, O_RDONLY);
+  quitif(fd<0, "Unable to open ELF binary file \"%s\"", f->filename);
+  struct stat st;
+  dieif(fstat(fd, &st), "fstat %s failed", f->filename);
+  char* base = (char*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  dieif(base==MAP_FAILED, "mmap %s failed", f->filename);
+  close(fd);
+  Elf64_Ehdr* eh = (Elf64_Ehdr*)base;
+  quitif(st.st_size < sizeof(Elf64_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG),
+	 "%s is not an ELF file", f->filename);
+  Elf64_Shdr* sh = (Elf64_Shdr*)(base + eh->e_shoff);
+  quitif(eh->e_shoff + eh->e_shnum*sizeof(Elf64_Shdr) > st.st_size, "%s section headers truncated", f->filename);
+
+  std::vector<symbol_t> v;
+  for (int i=0; i<eh->e_shnum; i++) {
+    if (sh[i].sh_type != SHT_SYMTAB)
+      continue;
+    Elf64_Sym* s = (Elf64_Sym*)(base + sh[i].sh_offset);
+    long n = sh[i].sh_size / sizeof(Elf64_Sym);
+    f->strings = base + sh[sh[i].sh_link].sh_offset;
+    // functions first so they win over plain labels at the same address
+    for (int pass=0; pass<2; pass++)
+      for (long k=0; k<n; k++) {
+	int type = ELF64_ST_TYPE(s[k].st_info);
+	if (type != (pass==0 ? STT_FUNC : STT_NOTYPE))
+	  continue;
+	const char* name = f->strings + s[k].st_name;
+	if (s[k].st_shndx==SHN_UNDEF || !*name || *name=='$' || strncmp(name, ".L", 2)==0)
+	  continue;
+	v.push_back({ s[k].st_value+f->bias, (uint32_t)s[k].st_size, s[k].st_name });
+      }
+    break;
+  }
+  std::stable_sort(v.begin(), v.end(), [](const symbol_t& a, const symbol_t& b) { return a.addr < b.addr; });
+  auto end = std::unique(v.begin(), v.end(), [](const symbol_t& a, const symbol_t& b) { return a.addr == b.addr; });
+  f->n = end - v.begin();
+  f->sym = new symbol_t[f->n];
+  std::copy(v.begin(), end, f->sym);
+  if (f->n > 0) {
+    f->lo = f->sym[0].addr;
+    f->hi = f->sym[f->n-1].addr + std::max(f->sym[f->n-1].size, 1U);
+  }
+  read_lines(f, base, sh, eh->e_shnum, base + sh[eh->e_shstrndx].sh_offset);
+  return 0;
+}
+
+void load_symbols(const char* filename, uintptr_t bias)
+{
+  pthread_mutex_lock(&symbol_lock);
+  quitif(symfiles==MAX_SYMFILES, "Too many symbol files");
+  symfile_t* f = &symfile[symfiles++];
+  f->filename = strdup(filename);
+  f->bias = bias;
+  f->running = true;
+  loaded = false;
+  dieif(pthread_create(&f->loader, 0, symbol_loader, f), "cannot create symbol loader thread");
+  pthread_mutex_unlock(&symbol_lock);
+}
+
+void wait_symbols()
+{
+  if (__atomic_load_n(&loaded, __ATOMIC_ACQUIRE))
+    return;
+  pthread_mutex_lock(&symbol_lock);
+  if (!loaded) {
+    for (int i=0; i<symfiles; i++)
+      if (symfile[i].running) {
+	pthread_join(symfile[i].loader, 0);
+	symfile[i].running = false;
+      }
+    generation++;
+    __atomic_store_n(&loaded, true, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&symbol_lock);
+}
+
+const char* find_symbol(uintptr_t pc, long* offset)
+{
+  wait_symbols();
+  if (last.generation==generation && last.lo<=pc && pc<last.hi) {
+    *offset = pc - last.lo;
+    return last.name;
+  }
+  // file with nearest symbols below pc
+  symfile_t* f = 0;
+  for (int i=0; i<symfiles; i++)
+    if (symfile[i].n>0 && symfile[i].lo<=pc && (!f || symfile[i].lo>f->lo))
+      f = &symfile[i];
+  if (!f || pc >= f->hi)
+    return 0;
+  // branchless: base advances by a conditional move, no unpredictable jumps
+  const symbol_t* base = f->sym;
+  long n = f->n;
+  while (n > 1) {
+    long half = n / 2;
+    base = (base[half].addr <= pc) ? base+half : base;
+    n -= half;
+  }
+  last.generation = generation;
+  last.lo = base->addr;
+  last.hi = (base+1 < f->sym+f->n) ? base[1].addr : f->hi;
+  last.name = f->strings + base->name;
+  *offset = pc - last.lo;
+  return last.name;
+}
+
+bool symbol_address(const char* name, uintptr_t* begin, uintptr_t* end)
+{
+  wait_symbols();
+  for (int i=0; i<symfiles; i++)
+    for (long k=0; k<symfile[i].n; k++)
+      if (strcmp(symfile[i].strings+symfile[i].sym[k].name, name) == 0) {
+	*begin = symfile[i].sym[k].addr;
+	if (end)
+	  *end = *begin + symfile[i].sym[k].size;
+	return true;
+      }
+  return false;
+}
+
+const char* find_line(uintptr_t pc, int* line)
+{
+  wait_symbols();
+  const line_t* row = 0;
+  if (last_line.generation==generation && last_line.lo<=pc && pc<last_line.hi)
+    row = last_line.row;
+  else {
+    symfile_t* f = 0;
+    for (int i=0; i<symfiles; i++)
+      if (symfile[i].nlines>0 && symfile[i].lines[0].addr<=pc && (!f || symfile[i].lines[0].addr>f->lines[0].addr))
+	f = &symfile[i];
+    if (!f)
+      return 0;
+    const line_t* base = f->lines;
+    long n = f->nlines;
+    while (n > 1) {
+      long half = n / 2;
+      base = (base[half].addr <= pc) ? base+half : base;
+      n -= half;
+    }
+    row = base;
+    last_line.generation = generation;
+    last_line.lo = base->addr;
+    last_line.hi = (base+1 < f->lines+f->nlines) ? base[1].addr : base->addr+1;
+    last_line.row = row;
+  }
+  if (row->file == 0)
+    return 0;
+  *line = row->line;
+  return files[row->file];
+}
@@ -0,0 +1,21 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Guest symbols for labelling pcs.  The .symtab and .strtab sections
+  are mapped from the ELF file, not read, and the function symbols
+  sorted once into a flat array searched by binary search.  Loading
+  happens in a background thread started by the loader; the first
+  lookup waits for it.  Each host thread remembers its last hit, so
+  consecutive pcs in one function cost a range check.
+
+  The .debug_line program of every compilation unit is run once at
+  load time into a similar sorted table of (pc, file, line) rows.
+*/
+
+void load_symbols(const char* filename, uintptr_t bias);
+void wait_symbols();		// loading finished, call before fork()
+const char* find_symbol(uintptr_t pc, long* offset); // nearest at or below pc, 0 if none
+bool symbol_address(const char* name, uintptr_t* begin, uintptr_t* end);
+const char* find_line(uintptr_t pc, int* line); // source file name, 0 if no line information
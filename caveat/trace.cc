@@ -0,0 +1,271 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <vector>
+
+#include "caveat.h"
+#include "hart.h"
+#include "trace.h"
+#include "affinity.h"
+
+#define TRACEBUFSZ  (1<<16)	// words buffered before writing
+
+struct recorder_t {
+  recorder_t* next;		// list of all recorders for trace_close()
+  FILE* f;
+  pthread_mutex_t lock;		// trace_close() may be called by another thread
+  bool closed;
+  uint64_t offset;		// file offset of buf[0]
+  uint64_t buf[TRACEBUFSZ];
+  long n;			// words in buf
+  trace_chunk_t chunk;		// current chunk
+  vector<trace_chunk_t> index;
+  vector<Header_t*> dictionary;	// indexed by block number
+  void flush();
+  void end_chunk();
+  void close();
+};
+
+static const char* trace_filename;
+static long trace_chunk_insns;
+static recorder_t* recorders;
+static pthread_mutex_t recorders_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local recorder_t* me;
+
+void trace_open(const char* filename, long chunk_insns)
+{
+  dieif(chunk_insns<=0, "trace chunk size %ld must be positive", chunk_insns);
+  trace_filename = filename;
+  trace_chunk_insns = chunk_insns;
+}
+
+static recorder_t* new_recorder(hart_t* h)
+{
+  recorder_t* r = new recorder_t;
+  char name[1024];
+  pthread_mutex_lock(&recorders_lock);
+  // first hart gets plain filename, clones get filename.tid
+  if (recorders)
+    snprintf(name, sizeof name, "%s.%d", trace_filename, h->tid());
+  else
+    snprintf(name, sizeof name, "%s", trace_filename);
+  r->f = fopen(name, "w");
+  quitif(!r->f, "Cannot open trace file %s", name);
+  r->next = recorders;
+  recorders = r;
+  pthread_mutex_unlock(&recorders_lock);
+  pthread_mutex_init(&r->lock, 0);
+  r->closed = false;
+  trace_header_t th;
+  memset(&th, 0, sizeof th);	// rewritten by close()
+  fwrite(&th, sizeof th, 1, r->f);
+  r->offset = sizeof th;
+  r->n = 0;
+  r->chunk.offset = r->offset;
+  r->chunk.words = 0;
+  r->chunk.insns = 0;
+  r->dictionary.push_back(0);	// block number 0 is never used
+  return r;
+}
+
+void recorder_t::flush()
+{
+  dieif(fwrite(buf, sizeof(uint64_t), n, f) != n, "trace write failed");
+  offset += n*sizeof(uint64_t);
+  n = 0;
+}
+
+void recorder_t::end_chunk()
+{
+  if (chunk.words > 0)
+    index.push_back(chunk);
+  chunk.offset = offset + n*sizeof(uint64_t);
+  chunk.words = 0;
+  chunk.insns = 0;
+}
+
+void trace_recorder(hart_t* h, Header_t* bb, uintptr_t* ap)
+{
+  if (!me)
+    me = new_recorder(h);
+  recorder_t* r = me;
+  quitif(bb->number==0, "trace recording needs the basic block interpreter");
+  long addrs = 0;
+  const Insn_t* i = insnp(bb+1);
+  for (long k=0; k<bb->count; k++, i++)
+    if (attributes[i->opcode()] & (ATTR_ld|ATTR_st))
+      addrs++;
+  pthread_mutex_lock(&r->lock);
+  if (r->closed) {
+    pthread_mutex_unlock(&r->lock);
+    return;
+  }
+  if (bb->number >= r->dictionary.size())
+    r->dictionary.resize(bb->number+1);
+  r->dictionary[bb->number] = bb;
+  if (r->n+1+addrs > TRACEBUFSZ)
+    r->flush();
+  r->buf[r->n++] = bb->number;
+  for (long k=0; k<addrs; k++)
+    r->buf[r->n++] = ap[k];
+  r->chunk.words += 1+addrs;
+  r->chunk.insns += bb->count;
+  if (r->chunk.insns >= trace_chunk_insns)
+    r->end_chunk();
+  pthread_mutex_unlock(&r->lock);
+}
+
+void recorder_t::close()
+{
+  end_chunk();
+  flush();
+  trace_header_t th;
+  th.magic = TRACE_MAGIC;
+  th.version = TRACE_VERSION;
+  th.opcodes = Number_of_Opcodes;
+  th.blocks = dictionary.size();
+  th.dictionary = offset;
+  Header_t empty(0, 0, 0, false);
+  for (Header_t* bb : dictionary) {
+    if (!bb)
+      fwrite(&empty, sizeof(Header_t), 1, f);
+    else
+      fwrite(bb, sizeof(uint64_t), 2+bb->count, f);
+  }
+  th.chunks = index.size();
+  th.index = ftell(f);
+  fwrite(index.data(), sizeof(trace_chunk_t), index.size(), f);
+  fseek(f, 0, SEEK_SET);
+  fwrite(&th, sizeof th, 1, f);
+  fclose(f);
+  closed = true;
+}
+
+void trace_close()
+{
+  pthread_mutex_lock(&recorders_lock);
+  for (recorder_t* r=recorders; r; r=r->next) {
+    pthread_mutex_lock(&r->lock);
+    if (!r->closed)
+      r->close();
+    pthread_mutex_unlock(&r->lock);
+  }
+  pthread_mutex_unlock(&recorders_lock);
+}
+
+
+/*
+  Replay maps the whole trace file.  Dictionary entries are used in place,
+  so a simulator sees exactly the Header_t and Insn_t it would have seen live.
+*/
+
+struct replay_t {
+  trace_header_t* th;
+  uint64_t* base;		// file mapped as words
+  trace_chunk_t* index;
+  Header_t** block;		// indexed by block number
+  uint8_t* addrs;		// number of address words following block number
+  int threads;
+  int warmup;
+  newhartfunc_t newhart;
+  warmedfunc_t warmed;
+  simfunc_t simulator;
+};
+
+struct replay_thread_t {
+  replay_t* r;
+  int slot;			// for pin_thread()
+  long begin, end;		// chunks [begin, end) measured after warmup
+  long warm;			// chunks [warm, begin) are warmup
+};
+
+static void replay_chunks(replay_t* r, hart_t* h, long from, long to)
+{
+  Header_t** block = r->block;
+  uint8_t* addrs = r->addrs;
+  simfunc_t simulator = r->simulator;
+  for (long c=from; c<to; c++) {
+    uint64_t* w = r->base + r->index[c].offset/sizeof(uint64_t);
+    uint64_t* end = w + r->index[c].words;
+    while (w < end) {
+      uint64_t n = *w++;
+      Header_t* bb = block[n];
+      h->count_insn(bb->count);
+      simulator(h, bb, (uintptr_t*)w);
+      w += addrs[n];
+    }
+  }
+}
+
+static void* replay_thread(void* arg)
+{
+  replay_thread_t* t = (replay_thread_t*)arg;
+  replay_t* r = t->r;
+  pin_thread(t->slot);
+  hart_t* h = r->newhart();
+  replay_chunks(r, h, t->warm, t->begin);
+  if (r->warmed)
+    r->warmed(h);
+  replay_chunks(r, h, t->begin, t->end);
+  return 0;
+}
+
+void replay_trace(const char* filename, int threads, int warmup, newhartfunc_t newhart, warmedfunc_t warmed, simfunc_t simulator)
+{
+  int fd = open(filename, O_RDONLY);
+  quitif(fd<0, "Cannot open trace file %s", filename);
+  struct stat st;
+  dieif(fstat(fd, &st), "cannot stat %s", filename);
+  quitif(st.st_size < sizeof(trace_header_t), "%s too short to be a trace", filename);
+  void* m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+  dieif(m==MAP_FAILED, "cannot mmap %s", filename);
+  close(fd);
+
+  replay_t r;
+  r.th = (trace_header_t*)m;
+  quitif(r.th->magic!=TRACE_MAGIC || r.th->version!=TRACE_VERSION, "%s is not a trace file", filename);
+  quitif(r.th->opcodes!=Number_of_Opcodes, "%s recorded with %d opcodes, expecting %d", filename, r.th->opcodes, Number_of_Opcodes);
+  r.base = (uint64_t*)m;
+  r.index = (trace_chunk_t*)((char*)m + r.th->index);
+  r.block = new Header_t*[r.th->blocks];
+  r.addrs = new uint8_t[r.th->blocks];
+  Header_t* bb = (Header_t*)((char*)m + r.th->dictionary);
+  for (long n=0; n<r.th->blocks; n++) {
+    r.block[n] = bb;
+    r.addrs[n] = 0;
+    const Insn_t* i = insnp(bb+1);
+    for (long k=0; k<bb->count; k++, i++)
+      if (attributes[i->opcode()] & (ATTR_ld|ATTR_st))
+	r.addrs[n]++;
+    bb = (Header_t*)(insnp(bb+1) + bb->count);
+  }
+  r.newhart = newhart;
+  r.warmed = warmed;
+  r.simulator = simulator;
+
+  long chunks = r.th->chunks;
+  if (threads > chunks)
+    threads = chunks > 0 ? chunks : 1;
+  replay_thread_t* t = new replay_thread_t[threads];
+  pthread_t* tnum = new pthread_t[threads];
+  for (int k=0; k<threads; k++) {
+    t[k].r = &r;
+    t[k].slot = k;
+    t[k].begin = k*chunks/threads;
+    t[k].end = (k+1)*chunks/threads;
+    t[k].warm = t[k].begin > warmup ? t[k].begin-warmup : 0;
+    dieif(pthread_create(&tnum[k], 0, replay_thread, &t[k]), "failed to launch replay thread %d", k);
+  }
+  for (int k=0; k<threads; k++)
+    pthread_join(tnum[k], 0);
+  delete[] tnum;
+  delete[] t;
+  delete[] r.block;
+  delete[] r.addrs;
+  munmap(m, st.st_size);
+}
@@ -0,0 +1,46 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  A trace records the basic blocks executed by one hart together with the
+  memory addresses each block touched, in the same form a simfunc_t sees them.
+  The file is laid out as
+
+    trace_header_t
+    chunk data		uint64_t words:  block number, then one address per ld/st
+    dictionary		for each block number, Header_t followed by Insn_t[count]
+    chunk index		trace_chunk_t[chunks]
+
+  so that a replay does not need the guest binary or hart_t execution, and
+  disjoint chunks can be replayed by different host threads.
+*/
+
+#define TRACE_MAGIC	0x6563617274617663L	// "cavatrace"
+#define TRACE_VERSION	1
+
+struct trace_header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t opcodes;		// Number_of_Opcodes when recorded
+  uint64_t blocks;		// number of dictionary entries (block 0 unused)
+  uint64_t dictionary;		// file offset of block dictionary
+  uint64_t chunks;		// number of chunks
+  uint64_t index;		// file offset of chunk index
+};
+
+struct trace_chunk_t {
+  uint64_t offset;		// file offset of first word
+  uint64_t words;		// length of chunk in words
+  uint64_t insns;		// instructions executed in chunk
+};
+
+// recording
+void trace_open(const char* filename, long chunk_insns);
+void trace_recorder(class hart_t* h, Header_t* bb, uintptr_t* ap);
+void trace_close();
+
+// replaying
+typedef class hart_t* (*newhartfunc_t)();
+typedef void (*warmedfunc_t)(class hart_t* h);
+void replay_trace(const char* filename, int threads, int warmup, newhartfunc_t newhart, warmedfunc_t warmed, simfunc_t simulator);
@@ -9,9 +9,19 @@
 
 #include "caveat.h"
 #include "hart.h"
+#include "trace.h"
+#include "bbv.h"
+#include "profile.h"
+#include "calls.h"
+#include "affinity.h"
 
 option<long> conf_report("report", 1, "Status report per second");
 option<bool> conf_step  ("step", false, true, "Single step");
+option<>     conf_trace ("trace", 0, "Record block and address trace to file");
+option<long> conf_chunk ("chunk", 100000000L, "Trace chunk size in instructions");
+option<long> conf_bbv   ("bbv", 0, "Basic block vector interval in instructions");
+option<>     conf_bbfile("bbfile", "bbv", "Basic block vector file name prefix");
+option<int>  conf_kmax  ("kmax", 0, "Cluster basic block vectors into at most k simpoints");
 
 void status_report()
 {
@@ -22,6 +32,7 @@ void status_report()
   double realtime = elapse_time();
   long total = 0;
   long flushed = 0;
+  hart_t::begin_walk();
   for (hart_t* p=hart_t::list(); p; p=p->next()) {
     total += p->executed();
     flushed += p->flushed();
@@ -43,11 +54,16 @@ void status_report()
   }
   else if (hart_t::num_harts() > 1)
     fprintf(stderr, "(%d cores)", hart_t::num_harts());
+  hart_t::end_walk();
+  if (conf_sysprof())
+    syscall_status();
 }
 
 int my_clone_proxy(class hart_t* parent)
 {
-  hart_t* child = new hart_t(parent);
+  hart_t* child = hart_t::reuse(parent);
+  if (!child)
+    child = new hart_t(parent);
   return clone_thread(child);
 }
 
@@ -56,6 +72,23 @@ void my_interpreter(hart_t* h)
   h->default_interpreter();
 }
 
+static simfunc_t roi_simulator;	// used only inside region of interest
+static thread_local long roi_insns;
+static thread_local double roi_time;
+
+void uspike_roi(hart_t* h, int what)
+{
+  if (what == ROI_BEGIN) {
+    h->simulator = roi_simulator;
+    roi_insns = h->executed();
+    roi_time = elapse_time();
+  }
+  else if (what == ROI_END) {
+    h->simulator = 0;
+    fprintf(stderr, "\nROI [%d] %ld insns in %3.1fs\n", h->tid(), h->executed()-roi_insns, elapse_time()-roi_time);
+  }
+}
+
 static jmp_buf return_to_top_level;
 
 static void segv_handler(int, siginfo_t*, void*) {
@@ -83,6 +116,7 @@ void signal_handler(int nSIGnum, siginfo_t* si, void* vcontext)
 
 void* status_thread(void* arg)
 {
+  pin_helper();
   while (1) {
     usleep(1000000/conf_report());
     status_report();
@@ -92,18 +126,43 @@ void* status_thread(void* arg)
 void exitfunc()
 {
   fprintf(stderr, "\nNormal exit\n");
+  if (conf_trace())
+    trace_close();
+  if (conf_bbv())
+    bbv_close();
   status_report();
   fprintf(stderr, "\n");
+  if (conf_sysprof())
+    syscall_report();
+  if (conf_profile())
+    profile_report(stderr, conf_profile());
+  if (conf_calls())
+    calls_report(stderr);
 }
 
 int main(int argc, const char* argv[], const char* envp[])
 {
   parse_options(argc, argv, "uspike: user-mode RISC-V interpreter derived from Spike");
-  if (argc == 0)
+  if (argc == 0 && !conf_restore())
     help_exit();
+  quitif(conf_hpm(), "--hpm needs a timing model, use cachesim or nsosim");
   // before creating harts
   mycpu = new hart_t(argc, argv, envp);
   mycpu->simulator = 0;
+  if (conf_trace()) {
+    trace_open(conf_trace(), conf_chunk());
+    mycpu->simulator = trace_recorder;
+  }
+  if (conf_bbv()) {
+    quitif(conf_trace(), "--bbv and --trace cannot be used together");
+    bbv_open(conf_bbfile(), conf_bbv(), conf_kmax());
+    mycpu->simulator = bbv_profiler;
+  }
+  if (conf_roi()) {
+    roi_simulator = mycpu->simulator;
+    mycpu->simulator = 0;
+    mycpu->roi = uspike_roi;
+  }
   mycpu->clone = my_clone_proxy;
   mycpu->riscv_syscall = default_riscv_syscall;
   mycpu->interpreter = my_interpreter;
@@ -0,0 +1,225 @@
+/*
+  Copyright (c) 2023 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Real-time viewer of the per-instruction counters a simulator run
+  with --live keeps in shared memory.  Erised only reads the segment,
+  so it can be started, stopped and restarted while the simulation
+  runs.  The hot list shows static instructions sorted by executions,
+  cycles or data cache misses; selecting one lists its function with
+  the counters of every instruction.
+*/
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <ncurses.h>
+#include <vector>
+#include <algorithm>
+
+#include "caveat.h"
+#include "symbols.h"
+#include "live.h"
+
+option<int> conf_refresh("refresh",	1000,		"Milliseconds between screen updates");
+
+enum view_t { Hot, Code };
+enum sort_t { By_count, By_cycles, By_dmiss };
+static const char* sort_name[] = { "executions", "cycles", "data misses" };
+
+static live_header_t* header;
+static live_t* counters;
+static long parcels;		// number of counters
+
+static view_t view = Hot;
+static sort_t sortkey = By_count;
+static long top;		// first line shown
+static long cursor;		// selected line
+static std::vector<uintptr_t> lines; // pc of each line of current view
+static live_t total;
+
+static uintptr_t pc_of(long k) { return header->base + 2*k; }
+static live_t* counter(uintptr_t pc) { return counters + (pc-header->base)/2; }
+
+static long value(const live_t* c)
+{
+  switch (sortkey) {
+  case By_count:	return c->count;
+  case By_cycles:	return c->cycles;
+  case By_dmiss:	return c->dmiss;
+  }
+  return 0;
+}
+
+static void add_totals()
+{
+  memset(&total, 0, sizeof total);
+  for (long k=0; k<parcels; k++) {
+    total.count  += counters[k].count;
+    total.cycles += counters[k].cycles;
+    total.imiss  += counters[k].imiss;
+    total.dmiss  += counters[k].dmiss;
+  }
+}
+
+// sort only as far as the screen reaches
+static void hot_lines(long rows)
+{
+  lines.clear();
+  for (long k=0; k<parcels; k++)
+    if (value(&counters[k]))
+      lines.push_back(pc_of(k));
+  long n = std::min((long)lines.size(), top+rows);
+  std::partial_sort(lines.begin(), lines.begin()+n, lines.end(),
+		    [](uintptr_t a, uintptr_t b) { return value(counter(a)) > value(counter(b)); });
+}
+
+// every instruction of function containing pc
+static void code_lines(uintptr_t pc)
+{
+  long offset = 0;
+  const char* name = find_symbol(pc, &offset);
+  uintptr_t begin = pc-offset;
+  uintptr_t b, end;
+  if (!name || !symbol_address(name, &b, &end) || b != begin || end <= pc)
+    end = header->end;		// size unknown, list to end of text
+  if (begin < header->base)
+    begin = pc;
+  if (end > header->end)
+    end = header->end;
+  lines.clear();
+  top = cursor = 0;
+  for (uintptr_t a=begin; a<end && lines.size()<100000; ) {
+    if (a == pc)
+      cursor = lines.size();
+    lines.push_back(a);
+    Insn_t i = decoder(a);
+    a += i.compressed() ? 2 : 4;
+  }
+}
+
+static void show_line(int y, uintptr_t pc)
+{
+  const live_t* c = counter(pc);
+  char buf[1024];
+  move(y, 0);
+  if (c->count)
+    printw("%12ld %6.2f%% %6.2f %8ld %8ld  ", c->count, 100.0*value(c)/(value(&total)?value(&total):1),
+	   (double)c->cycles/c->count, c->imiss, c->dmiss);
+  else
+    printw("%12s %7s %6s %8s %8s  ", "", "", "", "", "");
+  slabelpc(buf, pc);
+  printw("%s", buf);
+  Insn_t i = decoder(pc);
+  sdisasm(buf, pc, &i);
+  printw("%s", buf);
+  clrtoeol();
+}
+
+static void display()
+{
+  long rows = LINES-2;
+  add_totals();
+  if (view == Hot)
+    hot_lines(rows);
+  if (cursor >= (long)lines.size())
+    cursor = lines.size()-1;
+  if (cursor < 0)
+    cursor = 0;
+  if (cursor < top)
+    top = cursor;
+  if (cursor >= top+rows)
+    top = cursor-rows+1;
+  erase();
+  bool running = kill(header->pid, 0)==0 || errno==EPERM;
+  attron(A_REVERSE);
+  printw("%s pid %ld %s  %ld insns  CPI %5.3f  %ld imiss  %ld dmiss  by %s", header->path, header->pid,
+	 running ? "running" : "exited", total.count, total.count ? (double)total.cycles/total.count : 0.0,
+	 total.imiss, total.dmiss, sort_name[sortkey]);
+  clrtoeol();
+  attroff(A_REVERSE);
+  move(1, 0);
+  attron(A_UNDERLINE);
+  printw("%12s %7s %6s %8s %8s  %s", "executions", "%", "CPI", "imiss", "dmiss", "pc label");
+  clrtoeol();
+  attroff(A_UNDERLINE);
+  for (long l=top; l<top+rows && l<(long)lines.size(); l++) {
+    if (l == cursor)
+      attron(A_BOLD);
+    show_line(2+l-top, lines[l]);
+    if (l == cursor)
+      attroff(A_BOLD);
+  }
+  refresh();
+}
+
+static void select_line()
+{
+  if (view == Code) {
+    view = Hot;
+    top = cursor = 0;
+  }
+  else if (cursor < (long)lines.size()) {
+    view = Code;
+    code_lines(lines[cursor]);
+  }
+}
+
+static void interactive()
+{
+  initscr();
+  keypad(stdscr, true);
+  nonl();
+  cbreak();
+  noecho();
+  curs_set(0);
+  mousemask(BUTTON1_CLICKED|BUTTON4_PRESSED|BUTTON5_PRESSED, 0);
+  timeout(conf_refresh());
+  for (;;) {
+    display();
+    int ch = getch();
+    long page = LINES-2;
+    MEVENT m;
+    switch (ch) {
+    case 'q':
+      endwin();
+      return;
+    case KEY_UP:	cursor--;		break;
+    case KEY_DOWN:	cursor++;		break;
+    case KEY_PPAGE:	cursor-=page; top-=page; break;
+    case KEY_NPAGE:	cursor+=page; top+=page; break;
+    case KEY_HOME:	cursor = 0;		break;
+    case '\r':
+    case KEY_ENTER:	select_line();		break;
+    case 'c':		sortkey = By_count;	break;
+    case 'y':		sortkey = By_cycles;	break;
+    case 'm':		sortkey = By_dmiss;	break;
+    case KEY_MOUSE:
+      if (getmouse(&m) != OK)
+	break;
+      if (m.bstate & BUTTON4_PRESSED)
+	cursor -= 3;
+      else if (m.bstate & BUTTON5_PRESSED)
+	cursor += 3;
+      else if (m.bstate & BUTTON1_CLICKED && m.y >= 2) {
+	cursor = top + m.y-2;
+	select_line();
+      }
+      break;
+    }
+    if (top < 0)
+      top = 0;
+  }
+}
+
+int main(int argc, const char* argv[], const char* envp[])
+{
+  parse_options(argc, argv, "erised: real-time view of simulator per-instruction counters");
+  header = live_attach(conf_live() ? conf_live() : "caveat");
+  counters = live_array(header);
+  parcels = (header->end-header->base)/2;
+  const char* program = argc>0 ? argv[0] : header->path;
+  if (*program && access(program, R_OK)==0)
+    load_symbols(program, 0);
+  interactive();
+}
@@ -82,6 +82,8 @@ bool Core_t::clock_pipeline() {
     why_dispatch = Br_jumped;
     inhibit_dispatch = false;
   }
+  else if (roi_exit)
+    why_dispatch = Flush_wait;
   else if ((why_dispatch=ready_to_dispatch(ir)) == Ready) {
     // commit instruction for dispatch
     rename_input_regs(ir);
@@ -290,6 +292,7 @@ void Core_t::reset() {
 
   mem_checker_used = false;
   immediate_h = 0;
+  roi_exit = false;
 
   // get started
   pc = get_state();
@@ -62,7 +62,10 @@ private:
   friend int clone_proxy(hart_t* h);
 
 public:
+  bool roi_exit;		// stop dispatch after roi_end marker
+  
   void reset();
+  void leave_pipeline() { put_state(pc); roi_exit = false; } // when drained
   Core_t(hart_t* from) :hart_t(from) { reset(); }
   Core_t(int argc, const char* argv[], const char* envp[]) :hart_t(argc, argv, envp) { reset(); }
 
@@ -98,6 +101,7 @@ public:
   Core_t* next() { return (Core_t*)hart_t::next(); }
 
   long long insns() { return _insns; }
+  long long stalls(int why) { return dispatch_stalls[why]; }
   
   friend void clock_memory_system(Core_t* cpu);
   friend void display_history(WINDOW* w, int y, int x, Core_t* c, int lines);
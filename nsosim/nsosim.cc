@@ -11,6 +11,7 @@
 
 #include "caveat.h"
 #include "hart.h"
+#include "affinity.h"
 
 #include "components.h"
 #include "memory.h"
@@ -37,6 +38,58 @@ uint8_t latency[Number_of_Opcodes];
 
 long long stop_cycle = -1;
 
+/*
+  With --roi the guest runs in the functional interpreter until a roi_begin
+  marker, then in the pipeline model until roi_end drains the pipeline.
+*/
+static bool in_pipeline = true;
+static long long roi_cycle, roi_insns;
+
+static bool leave_interpreter(hart_t* h)
+{
+  h->event_at = LONG_MAX;
+  return true;
+}
+
+void nsosim_roi(hart_t* h, int what)
+{
+  Core_t* c = (Core_t*)h;
+  if (what == ROI_BEGIN && !in_pipeline) {
+    h->event_at = 0;		// after this basic block
+    h->event = leave_interpreter;
+  }
+  else if (what == ROI_END && in_pipeline)
+    c->roi_exit = true;
+}
+
+// pipeline model is single core, all harts see the global cycle count
+long nsosim_cycles(hart_t* h)
+{
+  return cycle;
+}
+
+// hpmcounter events are cycles dispatch stalled for each reason
+static const char* stall_events[Number_of_Reasons+1];
+
+long nsosim_counter(hart_t* h, int event)
+{
+  return ((Core_t*)h)->stalls(event);
+}
+
+static void name_stall_events()
+{
+  static char names[Number_of_Reasons][32];
+  for (int k=0; k<Number_of_Reasons; k++) {
+    switch (k) {
+    case Idle:	strcpy(names[k], "idle");	break;
+    case Ready:	strcpy(names[k], "ready");	break;
+    default:	snprintf(names[k], sizeof names[k], "stall.%s", reason_name[k]);
+    }
+    stall_events[k] = names[k];
+  }
+  stall_events[Number_of_Reasons] = 0;
+}
+
 void status_report()
 {
   long long total = 0;
@@ -57,10 +110,13 @@ void status_report()
   }
   else if (hart_t::num_harts() > 1)
     fprintf(stderr, "(%d cores)", hart_t::num_harts());
+  if (conf_sysprof())
+    syscall_status();
 }
 
 void* status_thread(void* arg)
 {
+  pin_helper();
   while (1) {
     usleep(1000000/conf_report());
     status_report();
@@ -74,6 +130,8 @@ void exitfunc()
   fprintf(stderr, "\nNormal exit\n");
   status_report();
   fprintf(stderr, "\n");
+  if (conf_sysprof())
+    syscall_report();
 }
 
 
@@ -235,8 +293,9 @@ void interactive(Core_t* cpu)
 int main(int argc, const char* argv[], const char* envp[])
 {
   parse_options(argc, argv, "nsosim: RISC-V non-speculative out-of-order simulator");
-  if (argc == 0)
+  if (argc == 0 && !conf_restore())
     help_exit();
+  quitif(conf_roi() && conf_visual(), "--roi only in non-interactive mode, add --visual");
 #if 0
   if (conf_trace())
     trace_file = fopen(conf_trace(), "w");
@@ -255,6 +314,10 @@ int main(int argc, const char* argv[], const char* envp[])
   Core_t* cpu = new Core_t(argc, argv, envp);
   cpu->clone = clone_proxy;
   cpu->riscv_syscall = ooo_riscv_syscall;
+  cpu->cycles = nsosim_cycles;
+  cpu->counter = nsosim_counter;
+  name_stall_events();
+  hpm_events(stall_events);
   atexit(exitfunc);
 
   if (conf_visual()) {
@@ -269,8 +332,29 @@ int main(int argc, const char* argv[], const char* envp[])
     }
     start_time();
     cpu->reset();
+    if (conf_roi()) {
+      cpu->roi = nsosim_roi;
+      in_pipeline = false;
+    }
     
     for (;;) {
+      if (!in_pipeline) {
+	cpu->simulator = 0;
+	cpu->riscv_syscall = default_riscv_syscall;
+	cpu->default_interpreter(); // returns at roi_begin
+	cpu->riscv_syscall = ooo_riscv_syscall;
+	cpu->reset();
+	in_pipeline = true;
+	roi_cycle = cycle;
+	roi_insns = cpu->insns();
+      }
+      if (cpu->roi_exit && cpu->inflight() == 0) {
+	cpu->leave_pipeline();
+	in_pipeline = false;
+	fprintf(stderr, "\nROI %lld cycles %lld insns IPC=%5.3f\n", cycle-roi_cycle, cpu->insns()-roi_insns,
+		(double)(cpu->insns()-roi_insns)/(cycle-roi_cycle));
+	continue;
+      }
 #ifdef VERIFY
       History_t* h = cpu->nextrob();
       h->expected_pc = cpu->get_pc_from_spike();
@@ -51,6 +51,13 @@ def gen_asm_header(f):
         if 'custom' not in attr:
             continue
 
+        # hint encodings need no assembler support
+        if 'roi' in attr:
+            f.write('inline void {:s}() {{ \n'.format(opcode))
+            f.write('  __asm__ __volatile__(".4byte {:s}" : : : "memory"); \n'.format(code))
+            f.write('};\n\n')
+            continue
+
         reglist = reglist.split(',')
         inargs = []
         inputs = []
@@ -134,6 +141,8 @@ def munge_riscv_opc_files(s, f):
                             continue
                         upper_op = opname.upper()
                         clas = 'I'
+                        if asm == '-':
+                            asm = ''
                         f.write('{{{:17} {:2d}, INSN_CLASS_{:s}, {:11s} MATCH_{:s}, MASK_{:s}, match_opcode, 0 }},\n'
                                 .format('"'+opcode+'",', 0, clas, '"'+asm+'",', upper_op, upper_op)) 
                 else: